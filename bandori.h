@@ -5,9 +5,22 @@
 #include "c/common.h"
 
 #include "c/defer.h"
+#include "c/cpu.h"
 #include "c/random.h"
 #include "c/memory.h"
+#include "c/numa.h"
+#include "c/pagemap.h"
+#include "c/arena.h"
+#include "c/pool.h"
+#include "c/ring.h"
+#include "c/parallel.h"
+#include "c/fileio.h"
+#include "c/pmem.h"
+#include "c/latency.h"
+#include "c/bandwidth.h"
 #include "c/timing.h"
+#include "c/histogram.h"
+#include "c/perf.h"
 #include "c/printer.h"
 #include "c/hexdump.h"
 #include "c/interactive.h"
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "defer.h"
+#include "memory.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Bump arena
+//
+
+// Default alignment of arena_alloc(), matching malloc on x86_64.
+#define ARENA_ALIGN 16
+
+// Chunks live at the start of their own mapping, so the hot path never mallocs.
+// Chunks are kept after a rewind and reused by later allocations.
+typedef struct arena_chunk {
+	struct arena_chunk *prev;
+	struct arena_chunk *next;
+	mmap_alloc_handle *handle;
+	size_t used; // Offset of the first free byte from the chunk start
+	size_t size;
+} arena_chunk;
+
+typedef struct arena {
+	arena_chunk *head;
+	arena_chunk *chunk; // Current chunk, NULL if nothing is allocated
+	size_t chunk_size;
+	bool huge; // Back chunks with mmap_alloc_huge()
+} arena;
+
+typedef struct arena_mark {
+	arena_chunk *chunk;
+	size_t used;
+} arena_mark;
+
+#define __ARENA_HEADER ALIGN(sizeof(arena_chunk), 64)
+
+// Initialize an arena, chunks are at least chunk_size bytes.
+fn void arena_init(arena *arena, size_t chunk_size, bool huge)
+{
+	arena->head = NULL;
+	arena->chunk = NULL;
+	arena->chunk_size = chunk_size ? chunk_size : MB(2);
+	arena->huge = huge;
+}
+
+// Release all chunks of an arena.
+fn void arena_destroy(arena *arena)
+{
+	arena_chunk *chunk = arena->head;
+
+	while (chunk) {
+		arena_chunk *next = chunk->next;
+		mmap_free(chunk->handle);
+		chunk = next;
+	}
+
+	arena->head = NULL;
+	arena->chunk = NULL;
+}
+
+// Map a chunk able to serve size bytes at the given alignment.
+fn arena_chunk *__arena_chunk_new(arena *arena, size_t size, size_t align)
+{
+	size_t need = ALIGN(__ARENA_HEADER + align + size, PAGE_SIZE);
+	mmap_alloc_handle *handle;
+	arena_chunk *chunk;
+
+	if (need < arena->chunk_size)
+		need = arena->chunk_size;
+
+	handle = arena->huge ? mmap_alloc_huge(need, PMD_SIZE) : mmap_alloc(need);
+	if (!handle) {
+		pr("Unable to map arena chunk of %s", format_size(need));
+		return NULL;
+	}
+
+	chunk = handle->map;
+	chunk->prev = NULL;
+	chunk->next = NULL;
+	chunk->handle = handle;
+	chunk->used = __ARENA_HEADER;
+	chunk->size = handle->size;
+
+	return chunk;
+}
+
+// Try to carve size bytes out of a chunk.
+fn void *__arena_carve(arena_chunk *chunk, size_t size, size_t align)
+{
+	size_t off = ALIGN((unsigned long) chunk + chunk->used, align) - (unsigned long) chunk;
+
+	if (off + size > chunk->size)
+		return NULL;
+
+	chunk->used = off + size;
+	return (u8 *) chunk + off;
+}
+
+// Allocate size bytes aligned to align (a power of two).
+// Return NULL if a new chunk cannot be mapped.
+fn void *arena_alloc_aligned(arena *arena, size_t size, size_t align)
+{
+	arena_chunk *chunk = arena->chunk;
+	arena_chunk *next;
+	void *ptr;
+
+	if (likely(chunk)) {
+		ptr = __arena_carve(chunk, size, align);
+		if (likely(ptr))
+			return ptr;
+	}
+
+	// Reuse the chunk kept after a rewind if it is large enough
+	next = chunk ? chunk->next : arena->head;
+	if (next) {
+		next->used = __ARENA_HEADER;
+		ptr = __arena_carve(next, size, align);
+		if (ptr) {
+			arena->chunk = next;
+			return ptr;
+		}
+	}
+
+	next = __arena_chunk_new(arena, size, align);
+	if (!next)
+		return NULL;
+
+	// Insert after the current chunk, ahead of any kept ones
+	next->prev = chunk;
+	next->next = chunk ? chunk->next : arena->head;
+	if (next->next)
+		next->next->prev = next;
+	if (chunk)
+		chunk->next = next;
+	else
+		arena->head = next;
+
+	arena->chunk = next;
+	return __arena_carve(next, size, align);
+}
+
+fn void *arena_alloc(arena *arena, size_t size)
+{
+	return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+fn void *arena_zalloc(arena *arena, size_t size)
+{
+	void *ptr = arena_alloc(arena, size);
+
+	if (ptr)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+#define arena_new(arena, type) ((type *) arena_alloc_aligned(arena, sizeof(type), __alignof__(type)))
+#define arena_new_array(arena, type, count) ((type *) arena_alloc_aligned(arena, sizeof(type) * (count), __alignof__(type)))
+
+// Take a checkpoint of the arena.
+fn arena_mark arena_save(arena *arena)
+{
+	arena_mark mark = { arena->chunk, arena->chunk ? arena->chunk->used : 0 };
+	return mark;
+}
+
+// Release everything allocated after the checkpoint in O(1).
+// Chunks are kept mapped for reuse until arena_destroy().
+fn void arena_rewind(arena *arena, arena_mark mark)
+{
+	arena->chunk = mark.chunk;
+	if (mark.chunk)
+		mark.chunk->used = mark.used;
+}
+
+// Release everything allocated in O(1).
+fn void arena_reset(arena *arena)
+{
+	arena->chunk = NULL;
+}
+
+// The arena pointer is captured first, since the defer body has its own "a" parameter.
+// It is spelled "struct arena" so that callers may name their variable "arena".
+#define __ARENA_SCOPE(ptr, n) \
+	struct arena *_DEFER_MERGE(____arena_scopeptr_, n) = (ptr); \
+	arena_mark _DEFER_MERGE(____arena_scopemark_, n) = arena_save(_DEFER_MERGE(____arena_scopeptr_, n)); \
+	defer { arena_rewind(_DEFER_MERGE(____arena_scopeptr_, n), _DEFER_MERGE(____arena_scopemark_, n)); }
+
+/// @brief Rewind the arena to its current state at the end of the scope.
+#define arena_scope(arena) __ARENA_SCOPE(arena, __COUNTER__)
@@ -0,0 +1,329 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "memory.h"
+#include "timing.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// STREAM-style bandwidth kernels
+//
+
+#define BW_READ 0 // Sum all of a
+#define BW_WRITE 1 // a = const
+#define BW_WRITE_NT 2 // a = const, non-temporal stores
+#define BW_COPY 3 // a = b
+#define BW_TRIAD 4 // a = b + s * c
+
+// Every slice is aligned to this, so vector and streaming stores are aligned.
+// Regions too small for that fall back to word aligned slices and scalar code.
+#define BW_ALIGN 64
+
+typedef struct bw_result {
+	double min; // GB/s
+	double median;
+	double max;
+	size_t bytes; // Bytes moved per repetition
+} bw_result;
+
+typedef struct __bw_worker {
+	pthread_t thread;
+	int cpu;
+	int kernel;
+	int reps;
+	u8 *a;
+	u8 *b;
+	u8 *c;
+	size_t len; // Bytes per array
+	bool vector; // Slices are aligned for the AVX2 kernel
+	u64 sink;
+	pthread_mutex_t *gate; // Held until the barrier is ready
+	pthread_barrier_t *barrier;
+} __bw_worker;
+
+fn const char *bw_kernel_name(int kernel)
+{
+	switch (kernel) {
+	case BW_READ: return "read";
+	case BW_WRITE: return "write";
+	case BW_WRITE_NT: return "write-nt";
+	case BW_COPY: return "copy";
+	case BW_TRIAD: return "triad";
+	default: return "unknown";
+	}
+}
+
+// Number of arrays a kernel touches, the region is split evenly among them.
+fn int __bw_arrays(int kernel)
+{
+	switch (kernel) {
+	case BW_COPY: return 2;
+	case BW_TRIAD: return 3;
+	default: return 1;
+	}
+}
+
+__attribute__((target("avx2")))
+fn void __bw_kernel_avx2(__bw_worker *w)
+{
+	size_t n = w->len / sizeof(__m256i);
+	__m256i *a = (__m256i *) w->a;
+	__m256i *b = (__m256i *) w->b;
+	__m256d *da = (__m256d *) w->a;
+	__m256d *db = (__m256d *) w->b;
+	__m256d *dc = (__m256d *) w->c;
+	__m256i v = _mm256_set1_epi64x(0x5a5a5a5a5a5a5a5aLL);
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+	__m256d s = _mm256_set1_pd(3.0);
+	size_t i;
+
+	switch (w->kernel) {
+	case BW_READ:
+		for (i = 0; i + 4 <= n; i += 4) {
+			acc0 = _mm256_xor_si256(acc0, _mm256_load_si256(a + i));
+			acc1 = _mm256_xor_si256(acc1, _mm256_load_si256(a + i + 1));
+			acc2 = _mm256_xor_si256(acc2, _mm256_load_si256(a + i + 2));
+			acc3 = _mm256_xor_si256(acc3, _mm256_load_si256(a + i + 3));
+		}
+		for (; i < n; i++)
+			acc0 = _mm256_xor_si256(acc0, _mm256_load_si256(a + i));
+		acc0 = _mm256_xor_si256(_mm256_xor_si256(acc0, acc1), _mm256_xor_si256(acc2, acc3));
+		w->sink ^= _mm256_extract_epi64(acc0, 0) ^ _mm256_extract_epi64(acc0, 3);
+		break;
+
+	case BW_WRITE:
+		for (i = 0; i < n; i++)
+			_mm256_store_si256(a + i, v);
+		break;
+
+	case BW_WRITE_NT:
+		for (i = 0; i < n; i++)
+			_mm256_stream_si256(a + i, v);
+		_mm_sfence();
+		break;
+
+	case BW_COPY:
+		for (i = 0; i < n; i++)
+			_mm256_store_si256(a + i, _mm256_load_si256(b + i));
+		break;
+
+	case BW_TRIAD:
+		for (i = 0; i < n; i++)
+			_mm256_store_pd((double *) (da + i), _mm256_add_pd(_mm256_load_pd((double *) (db + i)),
+				_mm256_mul_pd(s, _mm256_load_pd((double *) (dc + i)))));
+		break;
+	}
+}
+
+fn void __bw_kernel_scalar(__bw_worker *w)
+{
+	size_t n = w->len / sizeof(u64);
+	u64 *a = (u64 *) w->a;
+	u64 *b = (u64 *) w->b;
+	double *da = (double *) w->a;
+	double *db = (double *) w->b;
+	double *dc = (double *) w->c;
+	u64 acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+	size_t i;
+
+	switch (w->kernel) {
+	case BW_READ:
+		for (i = 0; i + 4 <= n; i += 4) {
+			acc0 ^= a[i];
+			acc1 ^= a[i + 1];
+			acc2 ^= a[i + 2];
+			acc3 ^= a[i + 3];
+		}
+		for (; i < n; i++)
+			acc0 ^= a[i];
+		w->sink ^= acc0 ^ acc1 ^ acc2 ^ acc3;
+		break;
+
+	case BW_WRITE:
+		for (i = 0; i < n; i++)
+			a[i] = 0x5a5a5a5a5a5a5a5aULL;
+		break;
+
+	case BW_WRITE_NT:
+		for (i = 0; i < n; i++)
+			_mm_stream_si64((long long *) (a + i), 0x5a5a5a5a5a5a5a5aLL);
+		_mm_sfence();
+		break;
+
+	case BW_COPY:
+		for (i = 0; i < n; i++)
+			a[i] = b[i];
+		break;
+
+	case BW_TRIAD:
+		for (i = 0; i < n; i++)
+			da[i] = db[i] + 3.0 * dc[i];
+		break;
+	}
+}
+
+fn void *__bw_thread(void *arg)
+{
+	__bw_worker *w = arg;
+	bool avx2 = w->vector && cpu_has(CPU_AVX2);
+
+	__memparallel_pin(w->cpu);
+
+	pthread_mutex_lock(w->gate);
+	pthread_mutex_unlock(w->gate);
+
+	for (int r = 0; r < w->reps; r++) {
+		pthread_barrier_wait(w->barrier);
+
+		if (avx2)
+			__bw_kernel_avx2(w);
+		else
+			__bw_kernel_scalar(w);
+
+		pthread_barrier_wait(w->barrier);
+	}
+
+	return NULL;
+}
+
+fn int __bw_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// Run a bandwidth kernel over the memory range with nthreads pinned workers.
+// The range is split evenly into the arrays the kernel needs, and each array
+// into one slice per worker. Every repetition is timed from a common start
+// to the slowest worker. When nthreads is 0, one worker per allowed CPU is used.
+// The range is expected to be faulted in already.
+fn bw_result bw_run(void *ptr, size_t size, int kernel, int nthreads, int reps)
+{
+	bw_result result = { 0 };
+	pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+	pthread_barrier_t barrier;
+	__bw_worker *workers;
+	cpu_set_t allowed;
+	double *rates;
+	u8 *base = PTR_ALIGN((u8 *) ptr, BW_ALIGN);
+	size_t align = BW_ALIGN;
+	size_t array, slice;
+	int arrays = __bw_arrays(kernel);
+	int cpu = -1;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		CPU_ZERO(&allowed);
+
+	if (nthreads <= 0)
+		nthreads = CPU_COUNT(&allowed) > 0 ? CPU_COUNT(&allowed) : 1;
+
+	if (reps <= 0)
+		reps = 1;
+
+	// Too small for one aligned stride per slice, run the scalar kernel on
+	// word aligned slices instead
+	if (size < (size_t) (base - (u8 *) ptr) + (size_t) BW_ALIGN * arrays * nthreads) {
+		base = PTR_ALIGN((u8 *) ptr, sizeof(u64));
+		align = sizeof(u64);
+	}
+
+	if (size < (size_t) (base - (u8 *) ptr)) {
+		pr("Region of %s is too small for %d threads", format_size(size), nthreads);
+		return result;
+	}
+
+	size -= base - (u8 *) ptr;
+	array = ALIGN_DOWN(size / arrays, align);
+	slice = ALIGN_DOWN(array / nthreads, align);
+	if (!slice) {
+		pr("Region of %s is too small for %d threads", format_size(size), nthreads);
+		return result;
+	}
+
+	workers = calloc(nthreads, sizeof(__bw_worker));
+	rates = calloc(reps, sizeof(double));
+	if (!workers || !rates) {
+		free(workers);
+		free(rates);
+		return result;
+	}
+
+	// Workers wait at the gate, so the barrier can be sized after spawning
+	pthread_mutex_lock(&gate);
+
+	for (int i = 0; i < nthreads; i++) {
+		__bw_worker *w = &workers[i];
+
+		w->cpu = cpu = __memparallel_next_cpu(&allowed, cpu);
+		w->kernel = kernel;
+		w->reps = reps;
+		w->a = base + i * slice;
+		w->b = base + array + i * slice;
+		w->c = base + 2 * array + i * slice;
+		w->len = slice;
+		w->vector = align == BW_ALIGN;
+		w->gate = &gate;
+		w->barrier = &barrier;
+
+		if (pthread_create(&w->thread, NULL, __bw_thread, w)) {
+			pr("Unable to spawn bandwidth worker %d, continue with %d threads", i, i);
+			nthreads = i;
+			break;
+		}
+	}
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	pthread_mutex_unlock(&gate);
+
+	result.bytes = slice * nthreads * arrays;
+
+	for (int r = 0; r < reps; r++) {
+		u64 begin, end;
+
+		pthread_barrier_wait(&barrier);
+		begin = get_current_ns();
+		pthread_barrier_wait(&barrier);
+		end = get_current_ns();
+
+		rates[r] = result.bytes * 1.0 / (end - begin);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	pthread_barrier_destroy(&barrier);
+
+	qsort(rates, reps, sizeof(double), __bw_cmp);
+	result.min = rates[0];
+	result.max = rates[reps - 1];
+	result.median = reps % 2 ? rates[reps / 2] : (rates[reps / 2 - 1] + rates[reps / 2]) / 2;
+
+	free(workers);
+	free(rates);
+
+	return result;
+}
+
+// Run a bandwidth kernel over any mmap_*_handle, they all expose map and size.
+#define mmap_bandwidth(handle, kernel, nthreads, reps) bw_run((handle)->map, (handle)->size, kernel, nthreads, reps)
+
+fn void bw_report(int kernel, bw_result *result)
+{
+	pr_info("%-8s %12s: min %8.2f  median %8.2f  max %8.2f GB/s\n", bw_kernel_name(kernel),
+		format_size(result->bytes), result->min, result->median, result->max);
+}
+
+// Run and report all kernels over the memory range.
+fn void bw_suite(void *ptr, size_t size, int nthreads, int reps)
+{
+	for (int kernel = BW_READ; kernel <= BW_TRIAD; kernel++) {
+		bw_result result = bw_run(ptr, size, kernel, nthreads, reps);
+		bw_report(kernel, &result);
+	}
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+
+//
+// CPU features
+//
+
+#define CPU_SSE2 BIT(0)
+#define CPU_OSXSAVE BIT(1)
+#define CPU_AVX2 BIT(2) // Also requires the OS to save YMM state
+#define CPU_AVX512F BIT(3) // Also requires the OS to save ZMM state
+#define CPU_RDRAND BIT(4)
+#define CPU_RDSEED BIT(5)
+#define CPU_CLFLUSH BIT(6)
+#define CPU_CLFLUSHOPT BIT(7)
+#define CPU_CLWB BIT(8)
+#define CPU_INVARIANT_TSC BIT(9)
+
+#define __CPU_FEATURES_VALID BIT(31)
+
+#define __CPUID_SSE2_MASK (1U << 26) // CPUID.1:EDX
+#define __CPUID_CLFLUSH_MASK (1U << 19) // CPUID.1:EDX
+#define __CPUID_OSXSAVE_MASK (1U << 27) // CPUID.1:ECX
+#define __CPUID_RDRAND_MASK (1U << 30) // CPUID.1:ECX
+#define __CPUID_AVX2_MASK (1U << 5) // CPUID.7:EBX
+#define __CPUID_AVX512F_MASK (1U << 16) // CPUID.7:EBX
+#define __CPUID_RDSEED_MASK (1U << 18) // CPUID.7:EBX
+#define __CPUID_CLFLUSHOPT_MASK (1U << 23) // CPUID.7:EBX
+#define __CPUID_CLWB_MASK (1U << 24) // CPUID.7:EBX
+#define __CPUID_INVARIANT_TSC_MASK (1U << 8) // CPUID.80000007H:EDX
+#define __XCR0_YMM_MASK (0x6U)
+#define __XCR0_ZMM_MASK (0xe6U)
+
+mut u32 __cpu_features_cache;
+
+fn void __cpu_cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+	__asm__ __volatile__(
+		"cpuid"
+		: "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+		: "a"(leaf), "c"(subleaf)
+	);
+}
+
+fn u32 __cpu_features_probe(void)
+{
+	unsigned int regs[4];
+	unsigned int max, xcr0 = 0;
+	u32 features = __CPU_FEATURES_VALID;
+
+	__cpu_cpuid(0, 0, regs);
+	max = regs[0];
+
+	__cpu_cpuid(1, 0, regs);
+
+	if (regs[3] & __CPUID_SSE2_MASK)
+		features |= CPU_SSE2;
+	if (regs[3] & __CPUID_CLFLUSH_MASK)
+		features |= CPU_CLFLUSH;
+	if (regs[2] & __CPUID_RDRAND_MASK)
+		features |= CPU_RDRAND;
+
+	// The OS must save the vector registers on context switch
+	if (regs[2] & __CPUID_OSXSAVE_MASK) {
+		unsigned int edx;
+
+		features |= CPU_OSXSAVE;
+		__asm__ __volatile__(
+			"xgetbv"
+			: "=a"(xcr0), "=d"(edx)
+			: "c"(0)
+		);
+	}
+
+	if (max >= 7) {
+		__cpu_cpuid(7, 0, regs);
+
+		if ((regs[1] & __CPUID_AVX2_MASK) && (xcr0 & __XCR0_YMM_MASK) == __XCR0_YMM_MASK)
+			features |= CPU_AVX2;
+		if ((regs[1] & __CPUID_AVX512F_MASK) && (xcr0 & __XCR0_ZMM_MASK) == __XCR0_ZMM_MASK)
+			features |= CPU_AVX512F;
+		if (regs[1] & __CPUID_RDSEED_MASK)
+			features |= CPU_RDSEED;
+		if (regs[1] & __CPUID_CLFLUSHOPT_MASK)
+			features |= CPU_CLFLUSHOPT;
+		if (regs[1] & __CPUID_CLWB_MASK)
+			features |= CPU_CLWB;
+	}
+
+	__cpu_cpuid(0x80000000, 0, regs);
+	if (regs[0] >= 0x80000007) {
+		__cpu_cpuid(0x80000007, 0, regs);
+
+		if (regs[3] & __CPUID_INVARIANT_TSC_MASK)
+			features |= CPU_INVARIANT_TSC;
+	}
+
+	return features;
+}
+
+// Get the CPU_* features of this CPU, probed once and cached.
+// It calls no library functions, so it is safe to call from ifunc resolvers.
+fn u32 cpu_features(void)
+{
+	u32 features = __atomic_load_n(&__cpu_features_cache, __ATOMIC_RELAXED);
+
+	if (unlikely(!features)) {
+		features = __cpu_features_probe();
+		__atomic_store_n(&__cpu_features_cache, features, __ATOMIC_RELAXED);
+	}
+
+	return features;
+}
+
+// Check if the CPU has all given CPU_* features.
+fn bool cpu_has(u32 features)
+{
+	return (cpu_features() & features) == features;
+}
+
+#define __CPU_VECTOR_SCALAR 0
+#define __CPU_VECTOR_AVX2 1
+#define __CPU_VECTOR_AVX512 2
+
+// Get the widest vector ISA usable by both the CPU and the OS.
+fn int __cpu_vector_level(void)
+{
+	u32 features = cpu_features();
+
+	if (features & CPU_AVX512F)
+		return __CPU_VECTOR_AVX512;
+
+	if (features & CPU_AVX2)
+		return __CPU_VECTOR_AVX2;
+
+	return __CPU_VECTOR_SCALAR;
+}
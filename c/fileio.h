@@ -0,0 +1,684 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+#include "ring.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Direct I/O alignment
+//
+
+// Alignment of buffers, offsets and sizes that satisfies O_DIRECT on any
+// logical block size in use.
+#define DIO_ALIGN 4096
+
+#define dio_align(x) ALIGN(x, DIO_ALIGN)
+#define dio_align_down(x) ALIGN_DOWN(x, DIO_ALIGN)
+#define dio_aligned(x) IS_ALIGNED((unsigned long) (x), DIO_ALIGN)
+
+//
+// Raw io_uring
+//
+
+typedef struct uring {
+	int fd;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	u32 *sq_head;
+	u32 *sq_tail;
+	u32 *sq_mask;
+	u32 *sq_entries;
+	u32 *sq_array;
+	u32 *cq_head;
+	u32 *cq_tail;
+	u32 *cq_mask;
+	struct io_uring_cqe *cqes;
+	u32 pending; // SQEs queued but not yet submitted
+} uring;
+
+fn int __io_uring_setup(u32 entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+fn int __io_uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+fn int __io_uring_register(int fd, u32 opcode, void *arg, u32 nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+fn void uring_destroy(uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+
+	if (ring->sq_map && ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map, ring->sq_map_size);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+// Set up a ring of at least depth entries, return -1 with errno set if the
+// kernel does not offer io_uring.
+fn int uring_init(uring *ring, u32 depth)
+{
+	struct io_uring_params params;
+	u8 *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = __io_uring_setup(depth, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Both rings may live in a single mapping
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		goto fail;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+			goto fail;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = ring->sq_map;
+	ring->sq_head = (u32 *) (sq + params.sq_off.head);
+	ring->sq_tail = (u32 *) (sq + params.sq_off.tail);
+	ring->sq_mask = (u32 *) (sq + params.sq_off.ring_mask);
+	ring->sq_entries = (u32 *) (sq + params.sq_off.ring_entries);
+	ring->sq_array = (u32 *) (sq + params.sq_off.array);
+
+	cq = ring->cq_map;
+	ring->cq_head = (u32 *) (cq + params.cq_off.head);
+	ring->cq_tail = (u32 *) (cq + params.cq_off.tail);
+	ring->cq_mask = (u32 *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return 0;
+
+fail:
+	uring_destroy(ring);
+	return -1;
+}
+
+// Get a zeroed SQE to fill in, or NULL when the submission ring is full.
+fn struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+	u32 tail = *ring->sq_tail;
+	u32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	u32 idx;
+
+	if (tail - head >= *ring->sq_entries)
+		return NULL;
+
+	idx = tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	memset(&ring->sqes[idx], 0, sizeof(struct io_uring_sqe));
+
+	// Published to the kernel by the next uring_submit()
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	return &ring->sqes[idx];
+}
+
+// Submit queued SQEs and wait for at least wait_nr completions.
+fn int uring_submit(uring *ring, u32 wait_nr)
+{
+	int ret;
+
+	do {
+		ret = __io_uring_enter(ring->fd, ring->pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -1;
+
+	ring->pending -= ret;
+	return ret;
+}
+
+// Get the oldest completion, or NULL if none is ready.
+fn struct io_uring_cqe *uring_peek_cqe(uring *ring)
+{
+	u32 head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+fn void uring_cqe_seen(uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//
+// Streaming file I/O
+//
+
+#define FILEIO_WRITE BIT(0) // Open for writing, creating the file if needed
+#define FILEIO_DIRECT BIT(1) // O_DIRECT, offsets and sizes must be DIO_ALIGN aligned
+#define FILEIO_PREAD BIT(2) // Skip io_uring, use the pread thread pool
+
+#define FILEIO_ENGINE_URING 0
+#define FILEIO_ENGINE_PREAD 1
+
+#define FILEIO_BLOCK MB(1)
+#define FILEIO_DEPTH 32
+#define FILEIO_THREADS 16 // Most threads of the pread engine
+
+typedef struct __fileio_slot {
+	u8 *buf;
+	off_t offset;
+	size_t len;
+	size_t done; // Bytes transferred by earlier short reads
+	ssize_t res; // Bytes transferred, or -errno
+} __fileio_slot;
+
+typedef struct fileio_chunk {
+	void *buf;
+	off_t offset;
+	size_t len;
+} fileio_chunk;
+
+// Requests go through depth slots, each owning a block-sized buffer carved
+// out of a single mapping. With io_uring the buffers are registered once,
+// so the kernel does not pin and unpin pages on every request.
+typedef struct fileio {
+	int fd;
+	int flags;
+	int engine; // FILEIO_ENGINE_*
+	u32 depth;
+	size_t block;
+	off_t size; // File size at open
+	mmap_alloc_handle *buffers;
+	__fileio_slot *slots;
+	u32 *free; // Stack of idle slots
+	u32 nfree;
+	u32 inflight;
+	off_t next; // Next offset to read
+	int held; // Slot handed out by fileio_read_next(), or -1
+	int error; // First errno seen
+	bool fixed; // Buffers registered with io_uring
+	uring ring;
+	pthread_t *threads;
+	u32 nthreads;
+	mpmc_u64 submitq;
+	mpmc_u64 completeq;
+	sem_t submitted;
+	sem_t completed;
+	bool stop;
+} fileio;
+
+fn void *__fileio_worker(void *arg)
+{
+	fileio *io = arg;
+	__fileio_slot *slot;
+	u64 id;
+
+	for (;;) {
+		while (sem_wait(&io->submitted) && errno == EINTR);
+
+		if (__atomic_load_n(&io->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		// The request is published before the semaphore is posted
+		while (!mpmc_u64_pop(&io->submitq, &id))
+			sched_yield();
+
+		slot = &io->slots[id];
+		if (io->flags & FILEIO_WRITE)
+			slot->res = pwrite(io->fd, slot->buf, slot->len, slot->offset);
+		else
+			slot->res = pread(io->fd, slot->buf + slot->done, slot->len - slot->done, slot->offset + slot->done);
+
+		if (slot->res < 0)
+			slot->res = -errno;
+
+		while (!mpmc_u64_push(&io->completeq, id))
+			sched_yield();
+		sem_post(&io->completed);
+	}
+
+	return NULL;
+}
+
+fn int __fileio_threads_init(fileio *io)
+{
+	size_t capacity = 2;
+	int ret;
+
+	while (capacity < io->depth)
+		capacity *= 2;
+
+	if (mpmc_u64_init(&io->submitq, capacity, RING_MALLOC) || mpmc_u64_init(&io->completeq, capacity, RING_MALLOC))
+		return -1;
+
+	sem_init(&io->submitted, 0, 0);
+	sem_init(&io->completed, 0, 0);
+
+	io->nthreads = io->depth < FILEIO_THREADS ? io->depth : FILEIO_THREADS;
+	io->threads = calloc(io->nthreads, sizeof(pthread_t));
+	if (!io->threads)
+		return -1;
+
+	for (u32 i = 0; i < io->nthreads; i++) {
+		ret = pthread_create(&io->threads[i], NULL, __fileio_worker, io);
+		if (ret) {
+			pr("Unable to spawn I/O worker %u: errno %d", i, ret);
+			io->nthreads = i;
+			break;
+		}
+	}
+
+	return io->nthreads ? 0 : -1;
+}
+
+fn void __fileio_threads_destroy(fileio *io)
+{
+	__atomic_store_n(&io->stop, true, __ATOMIC_RELEASE);
+
+	for (u32 i = 0; i < io->nthreads; i++)
+		sem_post(&io->submitted);
+
+	for (u32 i = 0; i < io->nthreads; i++)
+		pthread_join(io->threads[i], NULL);
+
+	free(io->threads);
+	mpmc_u64_destroy(&io->submitq);
+	mpmc_u64_destroy(&io->completeq);
+	sem_destroy(&io->submitted);
+	sem_destroy(&io->completed);
+}
+
+// Check that the kernel offers the plain read and write opcodes, io_uring of
+// kernels before 5.6 lacks them and fails every request with -EINVAL.
+fn bool __fileio_uring_probe(fileio *io)
+{
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	bool ok;
+
+	if (!probe)
+		return false;
+
+	// Probing itself is as new as the opcodes
+	ok = !__io_uring_register(io->ring.fd, IORING_REGISTER_PROBE, probe, 256) &&
+	     probe->last_op >= IORING_OP_WRITE &&
+	     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return ok;
+}
+
+fn int __fileio_uring_init(fileio *io)
+{
+	struct iovec *iov;
+
+	if (uring_init(&io->ring, io->depth))
+		return -1;
+
+	if (!__fileio_uring_probe(io)) {
+		uring_destroy(&io->ring);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	iov = calloc(io->depth, sizeof(struct iovec));
+	if (!iov)
+		return 0;
+
+	for (u32 i = 0; i < io->depth; i++) {
+		iov[i].iov_base = io->slots[i].buf;
+		iov[i].iov_len = io->block;
+	}
+
+	// Registration pins the buffers, it may exceed RLIMIT_MEMLOCK on older kernels
+	io->fixed = !__io_uring_register(io->ring.fd, IORING_REGISTER_BUFFERS, iov, io->depth);
+	if (!io->fixed)
+		pr_info("io_uring cannot register %s of buffers, use unregistered: errno %d\n", format_size(io->depth * io->block), errno);
+
+	free(iov);
+	return 0;
+}
+
+fn void __fileio_submit(fileio *io, u32 id)
+{
+	__fileio_slot *slot = &io->slots[id];
+	struct io_uring_sqe *sqe;
+	bool write = io->flags & FILEIO_WRITE;
+
+	io->inflight++;
+
+	if (io->engine == FILEIO_ENGINE_PREAD) {
+		while (!mpmc_u64_push(&io->submitq, id))
+			sched_yield();
+		sem_post(&io->submitted);
+		return;
+	}
+
+	while (!(sqe = uring_get_sqe(&io->ring)))
+		uring_submit(&io->ring, 0);
+
+	if (io->fixed)
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	sqe->fd = io->fd;
+	sqe->addr = (unsigned long) (slot->buf + slot->done);
+	sqe->len = slot->len - slot->done;
+	sqe->off = slot->offset + slot->done;
+	sqe->buf_index = id;
+	sqe->user_data = id;
+}
+
+// Wait for a request to complete, return its slot, or -1 if the ring broke
+// and all requests in flight are lost.
+fn int __fileio_reap(fileio *io)
+{
+	struct io_uring_cqe *cqe;
+	u64 id;
+
+	if (io->engine == FILEIO_ENGINE_PREAD) {
+		while (sem_wait(&io->completed) && errno == EINTR);
+		while (!mpmc_u64_pop(&io->completeq, &id))
+			sched_yield();
+	} else {
+		// Queued requests are submitted here, in one syscall
+		while (!(cqe = uring_peek_cqe(&io->ring))) {
+			if (uring_submit(&io->ring, 1) < 0) {
+				io->error = errno;
+				pr("io_uring_enter failed: errno %d", io->error);
+				io->inflight = 0;
+				return -1;
+			}
+		}
+
+		id = cqe->user_data;
+		io->slots[id].res = cqe->res;
+		uring_cqe_seen(&io->ring);
+	}
+
+	io->inflight--;
+
+	if (io->slots[id].res < 0 && !io->error)
+		io->error = -io->slots[id].res;
+
+	if ((io->flags & FILEIO_WRITE) && io->slots[id].res >= 0 && io->slots[id].res < io->slots[id].len && !io->error)
+		io->error = EIO;
+
+	return id;
+}
+
+fn void fileio_close(fileio *io)
+{
+	if (!io)
+		return;
+
+	while (io->inflight)
+		__fileio_reap(io);
+
+	if (io->engine == FILEIO_ENGINE_URING && io->ring.fd > 0)
+		uring_destroy(&io->ring);
+	else if (io->engine == FILEIO_ENGINE_PREAD && io->threads)
+		__fileio_threads_destroy(io);
+
+	if (io->buffers)
+		mmap_free(io->buffers);
+
+	if (io->fd >= 0)
+		close(io->fd);
+
+	free(io->slots);
+	free(io->free);
+	free(io);
+}
+
+// Open a file for streaming I/O of block-sized requests, depth of them in
+// flight. FILEIO_* flags select writing, O_DIRECT and the engine. Zero block
+// or depth picks the default. The block is rounded up to DIO_ALIGN.
+fn fileio *fileio_open(char *file, int flags, size_t block, u32 depth)
+{
+	fileio *io = calloc(1, sizeof(fileio));
+	int oflags = (flags & FILEIO_WRITE) ? O_RDWR | O_CREAT : O_RDONLY;
+	struct stat sb;
+
+	if (!io)
+		return NULL;
+
+	io->fd = -1;
+	io->held = -1;
+	io->flags = flags;
+	io->block = dio_align(block ? block : FILEIO_BLOCK);
+	io->depth = depth ? depth : FILEIO_DEPTH;
+
+	if (flags & FILEIO_DIRECT)
+		oflags |= O_DIRECT;
+
+	io->fd = open(file, oflags, 0644);
+	if (io->fd < 0) {
+		pr("Unable to open %s for I/O: errno %d", file, errno);
+		goto fail;
+	}
+
+	if (fstat(io->fd, &sb))
+		goto fail;
+
+	io->size = sb.st_size;
+
+	io->slots = calloc(io->depth, sizeof(__fileio_slot));
+	io->free = calloc(io->depth, sizeof(u32));
+	io->buffers = mmap_alloc(io->depth * io->block);
+	if (!io->slots || !io->free || !io->buffers) {
+		pr("Unable to allocate %u I/O buffers of %s", io->depth, format_size(io->block));
+		goto fail;
+	}
+
+	for (u32 i = 0; i < io->depth; i++) {
+		io->slots[i].buf = (u8 *) io->buffers->map + i * io->block;
+		io->free[io->nfree++] = io->depth - 1 - i;
+	}
+
+	io->engine = FILEIO_ENGINE_PREAD;
+	if (!(flags & FILEIO_PREAD)) {
+		if (!__fileio_uring_init(io))
+			io->engine = FILEIO_ENGINE_URING;
+		else
+			pr_info("io_uring unavailable, fallback to pread threads: errno %d\n", errno);
+	}
+
+	if (io->engine == FILEIO_ENGINE_PREAD && __fileio_threads_init(io)) {
+		pr("Unable to start pread threads for %s", file);
+		goto fail;
+	}
+
+	return io;
+
+fail:
+	fileio_close(io);
+	return NULL;
+}
+
+//
+// Streaming reads
+//
+
+// Get the next chunk of the file, return false at the end or on error.
+// Chunks arrive in completion order, not file order, and chunk->buf stays
+// valid until the next call. Up to depth blocks are read ahead meanwhile.
+fn bool fileio_read_next(fileio *io, fileio_chunk *chunk)
+{
+	__fileio_slot *slot;
+	int id;
+
+	if (io->held >= 0) {
+		io->free[io->nfree++] = io->held;
+		io->held = -1;
+	}
+
+	while (!io->error && io->nfree && io->next < io->size) {
+		id = io->free[--io->nfree];
+		slot = &io->slots[id];
+
+		slot->offset = io->next;
+		slot->len = io->size - io->next < io->block ? io->size - io->next : io->block;
+		slot->done = 0;
+
+		// O_DIRECT reads whole blocks, the kernel stops at the end of the file
+		if (io->flags & FILEIO_DIRECT)
+			slot->len = dio_align(slot->len);
+
+		io->next += io->block;
+		__fileio_submit(io, id);
+	}
+
+	while (io->inflight) {
+		id = __fileio_reap(io);
+		if (id < 0)
+			return false;
+
+		slot = &io->slots[id];
+		if (slot->res < 0) {
+			pr("Read at %lld failed: errno %d", (long long) slot->offset, (int) -slot->res);
+			io->free[io->nfree++] = id;
+			return false;
+		}
+
+		// Resubmit the rest of a short read, unless it hit the end of the
+		// file. O_DIRECT can only resume at an aligned offset, a short read
+		// ending anywhere else mid-file would lose the rest of the block.
+		slot->done += slot->res;
+		if (slot->res && slot->done < slot->len && slot->offset + slot->done < io->size) {
+			if ((io->flags & FILEIO_DIRECT) && !dio_aligned(slot->done)) {
+				pr("Direct read at %lld stopped at unaligned %zu bytes", (long long) slot->offset, slot->done);
+				io->error = EIO;
+				io->free[io->nfree++] = id;
+				return false;
+			}
+
+			__fileio_submit(io, id);
+			continue;
+		}
+
+		// The file shrank since open
+		if (!slot->done) {
+			io->free[io->nfree++] = id;
+			continue;
+		}
+
+		chunk->buf = slot->buf;
+		chunk->offset = slot->offset;
+		chunk->len = slot->done;
+
+		io->held = id;
+		return true;
+	}
+
+	return false;
+}
+
+typedef void (*fileio_fn)(void *buf, off_t offset, size_t len, void *arg);
+
+// Call func on every chunk of the file, in completion order.
+// Return 0, or -1 on I/O error.
+fn int fileio_read_all(fileio *io, fileio_fn func, void *arg)
+{
+	fileio_chunk chunk;
+
+	while (fileio_read_next(io, &chunk))
+		func(chunk.buf, chunk.offset, chunk.len, arg);
+
+	return io->error ? -1 : 0;
+}
+
+//
+// Streaming writes
+//
+
+// Get an idle block-sized buffer to fill, waiting for a write to finish if
+// all are in flight. Return NULL once a write has failed.
+fn void *fileio_write_buffer(fileio *io)
+{
+	int id;
+
+	if (!io->nfree && io->inflight) {
+		id = __fileio_reap(io);
+		if (id >= 0)
+			io->free[io->nfree++] = id;
+	}
+
+	if (io->error || !io->nfree)
+		return NULL;
+
+	return io->slots[io->free[--io->nfree]].buf;
+}
+
+// Queue a write of len bytes (at most a block) of a buffer from
+// fileio_write_buffer() at offset. The buffer is owned by the engine again.
+fn void fileio_write_submit(fileio *io, void *buf, off_t offset, size_t len)
+{
+	u32 id = ((u8 *) buf - (u8 *) io->buffers->map) / io->block;
+
+	io->slots[id].offset = offset;
+	io->slots[id].len = len < io->block ? len : io->block;
+	io->slots[id].done = 0;
+	__fileio_submit(io, id);
+}
+
+// Wait for all writes in flight. Return 0, or -1 if any write failed.
+fn int fileio_drain(fileio *io)
+{
+	int id;
+
+	while (io->inflight) {
+		id = __fileio_reap(io);
+		if (id >= 0)
+			io->free[io->nfree++] = id;
+	}
+
+	if (io->error)
+		pr("Write failed: errno %d", io->error);
+
+	return io->error ? -1 : 0;
+}
@@ -2,10 +2,205 @@
 
 #include "headers.h"
 #include "common.h"
+#include "cpu.h"
 
 #define HD_BINARY BIT(0)
 #define HD_CHARTX BIT(1)
 #define HD_OFFSET BIT(2)
+#define HD_SQUEEZE BIT(3) // Replace runs of lines identical to the previous one with "*"
+
+// Output is accumulated into blocks of this size before a single fwrite.
+#define HD_BLOCK_SIZE KB(256)
+
+static const char __hexdump_digits[16] = "0123456789abcdef";
+
+// Format the "0x%08lx  |  " offset prefix.
+fn char *__hexdump_offset(char *ptr, size_t offset)
+{
+	int digits = 8;
+
+	while (digits < 16 && (offset >> (digits * 4)))
+		digits++;
+
+	*ptr++ = '0';
+	*ptr++ = 'x';
+
+	for (int i = digits - 1; i >= 0; i--)
+		*ptr++ = __hexdump_digits[(offset >> (i * 4)) & 0xf];
+
+	memcpy(ptr, "  |  ", 5);
+	return ptr + 5;
+}
+
+// Format one line of at most linelen bytes, lrem of which are valid.
+fn char *__hexdump_line(char *ptr, const unsigned char *inptr, size_t lrem, int linelen, int split, int mode)
+{
+	int pos;
+	int splitcount;
+
+	if (mode & HD_BINARY) {
+		/*
+		 *	Loop through the hex chars of this line
+		 */
+		splitcount = 0;
+		for (pos = 0; pos < linelen; pos++) {
+
+			/* Split hex section if required */
+			if (split == splitcount++) {
+				*ptr++ = ' ';
+				*ptr++ = ' ';
+				splitcount = 1;
+			}
+
+			/* If still remaining chars, output, else leave a space */
+			if (pos < lrem) {
+				ptr[0] = __hexdump_digits[inptr[pos] >> 4];
+				ptr[1] = __hexdump_digits[inptr[pos] & 0xf];
+			} else {
+				ptr[0] = ' ';
+				ptr[1] = ' ';
+			}
+			ptr[2] = ' ';
+			ptr += 3;
+		}
+
+		if (!(mode & HD_CHARTX))
+			return ptr;
+
+		*ptr++ = ' ';
+		*ptr++ = '|';
+		*ptr++ = ' ';
+		*ptr++ = ' ';
+	}
+
+	/*
+	 *	Loop through the ASCII chars of this line
+	 */
+	splitcount = 0;
+	for (pos = 0; pos < linelen; pos++) {
+		unsigned char c;
+
+		/* Split ASCII section if required */
+		if (split == splitcount++) {
+			*ptr++ = ' ';
+			*ptr++ = ' ';
+			splitcount = 1;
+		}
+
+		if (pos < lrem) {
+			c = inptr[pos];
+			*ptr++ = (c > 31 && c < 127) ? c : '.';
+		} else {
+			*ptr++ = ' ';
+		}
+	}
+
+	return ptr;
+}
+
+// Find the first differing byte of two buffers, return len if identical.
+__attribute__((target("avx2")))
+fn size_t __hexdump_mismatch_avx2(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (a + i)), _mm256_loadu_si256((__m256i *) (b + i)));
+		__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (a + i + 32)), _mm256_loadu_si256((__m256i *) (b + i + 32)));
+		__m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (a + i + 64)), _mm256_loadu_si256((__m256i *) (b + i + 64)));
+		__m256i eq3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (a + i + 96)), _mm256_loadu_si256((__m256i *) (b + i + 96)));
+
+		eq0 = _mm256_and_si256(_mm256_and_si256(eq0, eq1), _mm256_and_si256(eq2, eq3));
+		if ((unsigned int) _mm256_movemask_epi8(eq0) != 0xffffffffU)
+			break;
+	}
+
+	for (; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) (a + i)), _mm256_loadu_si256((__m256i *) (b + i))));
+		if (mask != 0xffffffffU)
+			return i + __builtin_ctz(~mask);
+	}
+
+	for (; i < len; i++) {
+		if (a[i] != b[i])
+			return i;
+	}
+
+	return len;
+}
+
+// Find the first differing byte of two buffers, return len if identical.
+fn size_t __hexdump_mismatch_sse2(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (a + i)), _mm_loadu_si128((__m128i *) (b + i))));
+		if (mask != 0xffffU)
+			return i + __builtin_ctz(~mask);
+	}
+
+	for (; i < len; i++) {
+		if (a[i] != b[i])
+			return i;
+	}
+
+	return len;
+}
+
+fn size_t (*__resolve_hexdump_mismatch(void))(const unsigned char *, const unsigned char *, size_t)
+{
+	if (cpu_has(CPU_AVX2))
+		return __hexdump_mismatch_avx2;
+
+	return __hexdump_mismatch_sse2;
+}
+
+fn size_t __hexdump_mismatch(const unsigned char *a, const unsigned char *b, size_t len) __attribute__((ifunc("__resolve_hexdump_mismatch")));
+
+// Format a line marking the bytes that differ between a and b with '^',
+// aligned with the output of __hexdump_line().
+fn char *__hexdump_marks(char *ptr, const unsigned char *a, const unsigned char *b, size_t lrem, int linelen, int split, int mode)
+{
+	int pos;
+	int splitcount;
+
+	if (mode & HD_BINARY) {
+		splitcount = 0;
+		for (pos = 0; pos < linelen; pos++) {
+			if (split == splitcount++) {
+				*ptr++ = ' ';
+				*ptr++ = ' ';
+				splitcount = 1;
+			}
+
+			ptr[0] = ptr[1] = (pos < lrem && a[pos] != b[pos]) ? '^' : ' ';
+			ptr[2] = ' ';
+			ptr += 3;
+		}
+
+		if (!(mode & HD_CHARTX))
+			return ptr;
+
+		memcpy(ptr, "    ", 4);
+		ptr += 4;
+	}
+
+	splitcount = 0;
+	for (pos = 0; pos < linelen; pos++) {
+		if (split == splitcount++) {
+			*ptr++ = ' ';
+			*ptr++ = ' ';
+			splitcount = 1;
+		}
+
+		*ptr++ = (pos < lrem && a[pos] != b[pos]) ? '^' : ' ';
+	}
+
+	return ptr;
+}
 
 /*
  *	hexdump - output a hex dump of a buffer
@@ -15,127 +210,182 @@
  *	length is length of buffer to write
  *	linelen is number of chars to output per line
  *	split is number of chars in each chunk on a line
+ *
+ *	Lines are formatted with lookup tables into a block buffer, which is
+ *	flushed with a single fwrite each time it fills up.
  */
 fn int hexdump_core(FILE *fd, void const *data, size_t length, int linelen, int split, int mode)
 {
+	const unsigned char *inptr = data;
+	size_t remaining = length;
+	size_t linemax, blocksize;
 	char *buffer;
 	char *ptr;
-	const void *inptr;
-	int pos;
-	int remaining = length;
+	int ret = 0;
 
-	inptr = data;
+	/* Nothing to do */
+	if (!(mode & (HD_BINARY | HD_CHARTX)))
+		return -1;
 
 	/*
-	 *	Assert that the buffer is large enough. This should pretty much
-	 *	always be the case...
+	 *	Worst case of a line:
 	 *
-	 *	hex/ascii gap (2 chars) + closing \0 (1 char)
+	 *	offset "0x" + 16 digits + "  |  " (23 chars) + hex/ascii gap (4 chars)
 	 *	split = 4 chars (2 each for hex/ascii) * number of splits
-	 *
 	 *	(hex = 3 chars, ascii = 1 char) * linelen number of chars
+	 *	closing \n (1 char)
 	 */
-	buffer = malloc(32 + (4 * (linelen / split)) + (linelen * 4));
+	linemax = 32 + (4 * (linelen / split + 1)) + (linelen * 4);
+	blocksize = linemax > HD_BLOCK_SIZE ? linemax : HD_BLOCK_SIZE;
+
+	buffer = malloc(blocksize);
 	if (!buffer)
 		return -1;
 
-	/* Nothing to do */
-	if (!(mode & (HD_BINARY | HD_CHARTX)))
-		return -1;
+	ptr = buffer;
 
 	/*
 	 *	Loop through each line remaining
 	 */
 	while (remaining > 0) {
-		int lrem;
-		int splitcount;
-		ptr = buffer;
+		size_t lrem = remaining < linelen ? remaining : linelen;
 
-		if (mode & HD_OFFSET) {
-			lrem = sprintf(ptr, "0x%08lx  |  ", inptr - data);
-			if (lrem >= 0)
-				ptr += lrem;
+		if (buffer + blocksize - ptr < linemax) {
+			if (fwrite(buffer, 1, ptr - buffer, fd) != ptr - buffer)
+				ret = -1;
+			ptr = buffer;
 		}
 
-		if (!(mode & HD_BINARY))
-			goto print_chartx;
+		/* Skip full lines identical to the previous one */
+		if ((mode & HD_SQUEEZE) && inptr != data && remaining >= linelen) {
+			size_t full = remaining - remaining % linelen;
+			size_t same = __hexdump_mismatch(inptr - linelen, inptr, full) / linelen * linelen;
 
-		/*
-		 *	Loop through the hex chars of this line
-		 */
-		lrem = remaining;
-		splitcount = 0;
-		for (pos = 0; pos < linelen; pos++) {
-
-			/* Split hex section if required */
-			if (split == splitcount++) {
-				sprintf(ptr, "  ");
-				ptr += 2;
-				splitcount = 1;
+			if (same) {
+				*ptr++ = '*';
+				*ptr++ = '\n';
+				inptr += same;
+				remaining -= same;
+				continue;
 			}
+		}
 
-			/* If still remaining chars, output, else leave a space */
-			if (lrem) {
-				sprintf(ptr, "%02x ", *((unsigned char *) inptr + pos));
-				lrem--;
-			} else {
-				sprintf(ptr, "   ");
-			}
-			ptr += 3;
+		if (mode & HD_OFFSET)
+			ptr = __hexdump_offset(ptr, inptr - (const unsigned char *) data);
+
+		ptr = __hexdump_line(ptr, inptr, lrem, linelen, split, mode);
+		*ptr++ = '\n';
+
+		inptr += lrem;
+		remaining -= lrem;
+	}
+
+	if (ptr != buffer && fwrite(buffer, 1, ptr - buffer, fd) != ptr - buffer)
+		ret = -1;
+
+	free(buffer);
+
+	return ret;
+}
+
+/*
+ *	hexdump_diff - output the lines that differ between two buffers
+ *
+ *	Each differing line is printed as "-" (from a), "+" (from b), then a
+ *	line of '^' under the differing bytes. Identical stretches are skipped
+ *	with wide vector compares.
+ *
+ *	Return 0 if the buffers are identical, 1 if they differ, -1 on error.
+ */
+fn int hexdump_diff_core(FILE *fd, void const *a, void const *b, size_t length, int linelen, int split, int mode)
+{
+	const unsigned char *pa = a;
+	const unsigned char *pb = b;
+	size_t offset = 0;
+	size_t linemax, blocksize;
+	char *buffer;
+	char *ptr;
+	int ret = 0;
+
+	/* Nothing to do */
+	if (!(mode & (HD_BINARY | HD_CHARTX)))
+		return -1;
+
+	/* Three lines per difference, each with a 2 chars prefix */
+	linemax = 3 * (34 + (4 * (linelen / split + 1)) + (linelen * 4));
+	blocksize = linemax > HD_BLOCK_SIZE ? linemax : HD_BLOCK_SIZE;
+
+	buffer = malloc(blocksize);
+	if (!buffer)
+		return -1;
+
+	ptr = buffer;
+
+	while (offset < length) {
+		size_t lrem;
+
+		offset += __hexdump_mismatch(pa + offset, pb + offset, length - offset);
+		if (offset >= length)
+			break;
+
+		offset -= offset % linelen;
+		lrem = length - offset < linelen ? length - offset : linelen;
+
+		if (buffer + blocksize - ptr < linemax) {
+			if (fwrite(buffer, 1, ptr - buffer, fd) != ptr - buffer)
+				ret = -1;
+			ptr = buffer;
 		}
 
-		if (!(mode & HD_CHARTX))
-			goto done;
+		*ptr++ = '-';
+		*ptr++ = ' ';
+		if (mode & HD_OFFSET)
+			ptr = __hexdump_offset(ptr, offset);
+		ptr = __hexdump_line(ptr, pa + offset, lrem, linelen, split, mode);
+		*ptr++ = '\n';
 
+		*ptr++ = '+';
 		*ptr++ = ' ';
-		*ptr++ = '|';
+		if (mode & HD_OFFSET)
+			ptr = __hexdump_offset(ptr, offset);
+		ptr = __hexdump_line(ptr, pb + offset, lrem, linelen, split, mode);
+		*ptr++ = '\n';
+
 		*ptr++ = ' ';
 		*ptr++ = ' ';
-
-print_chartx:
-		/*
-		 *	Loop through the ASCII chars of this line
-		 */
-		lrem = remaining;
-		splitcount = 0;
-		for (pos = 0; pos < linelen; pos++) {
-			unsigned char c;
-
-			/* Split ASCII section if required */
-			if (split == splitcount++) {
-				sprintf(ptr, "  ");
-				ptr += 2;
-				splitcount = 1;
-			}
-
-			if (lrem) {
-				c = *((unsigned char *) inptr + pos);
-				if (c > 31 && c < 127) {
-					sprintf(ptr, "%c", c);
-				} else {
-					sprintf(ptr, ".");
-				}
-				lrem--;
-			} else {
-				sprintf(ptr, " ");
-			}
-			ptr++;
+		if (mode & HD_OFFSET) {
+			char *end = __hexdump_offset(ptr, offset);
+			memset(ptr, ' ', end - ptr);
+			ptr = end;
 		}
+		ptr = __hexdump_marks(ptr, pa + offset, pb + offset, lrem, linelen, split, mode);
+		*ptr++ = '\n';
 
-done:
-		*ptr = '\0';
-		fprintf(fd, "%s\n", buffer);
+		if (!ret)
+			ret = 1;
 
-		inptr += linelen;
-		remaining -= linelen;
+		offset += lrem;
 	}
 
+	if (ptr != buffer && fwrite(buffer, 1, ptr - buffer, fd) != ptr - buffer)
+		ret = -1;
+
 	free(buffer);
 
-	return 0;
+	return ret;
 }
 
 fn int hexdump(void const *data, size_t length)
 {
 	return hexdump_core(stdout, data, length, 32, 8, HD_OFFSET | HD_BINARY | HD_CHARTX);
 }
+
+fn int hexdump_squeeze(void const *data, size_t length)
+{
+	return hexdump_core(stdout, data, length, 32, 8, HD_OFFSET | HD_BINARY | HD_CHARTX | HD_SQUEEZE);
+}
+
+fn int hexdump_diff(void const *a, void const *b, size_t length)
+{
+	return hexdump_diff_core(stdout, a, b, length, 32, 8, HD_OFFSET | HD_BINARY | HD_CHARTX);
+}
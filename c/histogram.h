@@ -0,0 +1,172 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Log-linear histogram
+//
+
+// Values below 2^HIST_SUB_BITS are counted exactly. Above that, every power of
+// two is split into 2^(HIST_SUB_BITS - 1) linear buckets, so the relative error
+// of any recorded value is below 2^-(HIST_SUB_BITS - 1) (0.8%).
+#define HIST_SUB_BITS 8
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+// The counters are owned by a single recording thread. Merging and reporting
+// only use relaxed atomics, so they are safe while the owner keeps recording.
+typedef struct histogram {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u64 buckets[HIST_BUCKETS];
+} histogram;
+
+fn void hist_init(histogram *hist)
+{
+	memset(hist, 0, sizeof(histogram));
+	hist->min = -1ULL;
+}
+
+// Get the bucket index of a value.
+fn int __hist_index(u64 value)
+{
+	int msb;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+
+	return HIST_SUB_COUNT + (msb - HIST_SUB_BITS) * HIST_HALF_COUNT +
+		((value >> (msb - HIST_SUB_BITS + 1)) - HIST_HALF_COUNT);
+}
+
+// Get the highest value that falls into a bucket.
+fn u64 __hist_value(int index)
+{
+	int shift;
+	u64 mantissa;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	index -= HIST_SUB_COUNT;
+	shift = index / HIST_HALF_COUNT + 1;
+	mantissa = HIST_HALF_COUNT + index % HIST_HALF_COUNT;
+
+	return ((mantissa + 1) << shift) - 1;
+}
+
+// Add to a counter only the owner writes. Relaxed loads and stores compile to
+// plain moves, but keep concurrent readers free of data races.
+fn void __hist_add(u64 *counter, u64 delta)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+// Record a value, only the owner thread may call this.
+// It is O(1) and never allocates.
+fn void hist_record(histogram *hist, u64 value)
+{
+	__hist_add(&hist->buckets[__hist_index(value)], 1);
+	__hist_add(&hist->count, 1);
+	__hist_add(&hist->sum, value);
+
+	if (value < hist->min)
+		__atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+// Record a value into a histogram shared by multiple threads.
+fn void hist_record_shared(histogram *hist, u64 value)
+{
+	u64 cur;
+
+	__atomic_fetch_add(&hist->buckets[__hist_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+
+	cur = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+	while (value < cur && !__atomic_compare_exchange_n(&hist->min, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	cur = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (value > cur && !__atomic_compare_exchange_n(&hist->max, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Merge src into dst. Multiple threads may merge into the same dst concurrently.
+fn void hist_merge(histogram *dst, histogram *src)
+{
+	u64 val, cur;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		val = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+		if (val)
+			__atomic_fetch_add(&dst->buckets[i], val, __ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_add(&dst->count, __atomic_load_n(&src->count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dst->sum, __atomic_load_n(&src->sum, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	val = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+	cur = __atomic_load_n(&dst->min, __ATOMIC_RELAXED);
+	while (val < cur && !__atomic_compare_exchange_n(&dst->min, &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	val = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	cur = __atomic_load_n(&dst->max, __ATOMIC_RELAXED);
+	while (val > cur && !__atomic_compare_exchange_n(&dst->max, &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Get the value at the given percentile (0 to 100).
+// The result is the highest value of its bucket, capped by the recorded max.
+fn u64 hist_percentile(histogram *hist, double percentile)
+{
+	u64 count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	u64 max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	u64 target, seen = 0;
+
+	if (!count)
+		return 0;
+
+	if (percentile >= 100)
+		return max;
+
+	target = (u64) ceil(count * percentile / 100.0);
+	if (!target)
+		target = 1;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return __hist_value(i) < max ? __hist_value(i) : max;
+	}
+
+	return max;
+}
+
+fn double hist_mean(histogram *hist)
+{
+	return hist->count ? hist->sum * 1.0 / hist->count : 0;
+}
+
+// Print count, mean and p50/p90/p99/p99.9/max of the histogram.
+fn void hist_report(histogram *hist, char *name, char *unit)
+{
+	if (!hist->count) {
+		pr_info("%s: no samples\n", name);
+		return;
+	}
+
+	pr_info("%s: %llu samples, mean %.2f %s, min %llu %s\n", name,
+		hist->count, hist_mean(hist), unit, hist->min, unit);
+	pr_info("\tp50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu %s\n",
+		hist_percentile(hist, 50), hist_percentile(hist, 90), hist_percentile(hist, 99),
+		hist_percentile(hist, 99.9), hist->max, unit);
+}
@@ -41,7 +41,14 @@ typedef __u64 u64;
 // linux/printk.h (Modified)
 //
 
+#ifdef CONFIG_ASYNC_PRINTK
+static inline int __async_printk(const char *fmt, ...);
+#define printk(...) __async_printk(__VA_ARGS__)
+#else
 #define printk(...) do { printf(__VA_ARGS__); fflush(stdout); } while(0)
+#define printk_sync() fflush(stdout)
+#endif
+
 #define pr_emerg(...) printk(__VA_ARGS__)
 #define pr_alert(...) printk(__VA_ARGS__)
 #define pr_crit(...) printk(__VA_ARGS__)
@@ -297,6 +304,20 @@ typedef __u64 u64;
 #define IOCSIZE_MASK	(_IOC_SIZEMASK << _IOC_SIZESHIFT)
 #define IOCSIZE_SHIFT	(_IOC_SIZESHIFT)
 
+//
+// uapi/linux/mempolicy.h
+//
+
+#define MPOL_DEFAULT	0
+#define MPOL_PREFERRED	1
+#define MPOL_BIND	2
+#define MPOL_INTERLEAVE	3
+#define MPOL_LOCAL	4
+
+#define MPOL_MF_STRICT	(1<<0)
+#define MPOL_MF_MOVE	(1<<1)
+#define MPOL_MF_MOVE_ALL	(1<<2)
+
 //
 // include/vdso/time64.h
 //
@@ -309,3 +330,11 @@ typedef __u64 u64;
 #define NSEC_PER_SEC	1000000000L
 #define PSEC_PER_SEC	1000000000000LL
 #define FSEC_PER_SEC	1000000000000000LL
+
+//
+// Asynchronous printk backend
+//
+
+#ifdef CONFIG_ASYNC_PRINTK
+#include "log.h"
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+#include "timing.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Pointer chase
+//
+
+#define CHASE_CROSS_PAGE 0 // One random cycle over all slots
+#define CHASE_PAGE_LOCAL 1 // Random page order, random slot order within each page
+
+// Link the memory range into a single random cycle, one pointer every stride bytes.
+// The stride must be a multiple of pointer size. Page-local mode visits every
+// slot of a page before moving on, so TLB misses are mostly taken out.
+// Return the start of the cycle, or NULL on error.
+fn void *chase_build(void *ptr, size_t size, size_t stride, int mode)
+{
+	size_t slots = stride ? size / stride : 0;
+	size_t per_page = 1;
+	u64 *order;
+
+	if (!stride || stride % sizeof(void *) || !slots) {
+		pr("Invalid chase of %s with stride %zu", format_size(size), stride);
+		return NULL;
+	}
+
+	order = malloc(slots * sizeof(u64));
+	if (!order)
+		return NULL;
+
+	for (size_t i = 0; i < slots; i++)
+		order[i] = i;
+
+	if (mode == CHASE_PAGE_LOCAL && stride < PAGE_SIZE) {
+		per_page = PAGE_SIZE / stride;
+
+		if (PAGE_SIZE % stride)
+			pr("Stride %zu does not divide a page, page-local runs of %zu slots straddle pages", stride, per_page);
+	}
+
+	if (per_page == 1) {
+		memshuffle_64(order, slots);
+	} else {
+		// The last page may be partial, it gets the slots that are left
+		size_t pages = __KERNEL_DIV_ROUND_UP(slots, per_page);
+		u64 *page_order = malloc(pages * sizeof(u64));
+		u64 *slot = order;
+
+		if (!page_order) {
+			free(order);
+			return NULL;
+		}
+
+		for (size_t i = 0; i < pages; i++)
+			page_order[i] = i;
+
+		memshuffle_64(page_order, pages);
+
+		for (size_t i = 0; i < pages; i++) {
+			size_t first = page_order[i] * per_page;
+			size_t count = slots - first < per_page ? slots - first : per_page;
+
+			for (size_t j = 0; j < count; j++)
+				slot[j] = first + j;
+
+			memshuffle_64(slot, count);
+			slot += count;
+		}
+
+		free(page_order);
+	}
+
+	for (size_t i = 0; i < slots; i++) {
+		void **cur = ptr + order[i] * stride;
+		void **next = ptr + order[(i + 1) % slots] * stride;
+		*cur = next;
+	}
+
+	ptr += order[0] * stride;
+	free(order);
+
+	return ptr;
+}
+
+// Follow the chase for the given number of loads, return ns per load.
+fn double chase_run(void *start, size_t loads)
+{
+	void **p = start;
+	u64 begin, end;
+	size_t i;
+
+	begin = get_current_ns();
+
+	for (i = 0; i + 8 <= loads; i += 8) {
+		p = *p; p = *p; p = *p; p = *p;
+		p = *p; p = *p; p = *p; p = *p;
+	}
+
+	for (; i < loads; i++)
+		p = *p;
+
+	end = get_current_ns();
+
+	// Keep the chain alive
+	__asm__ __volatile__("" : : "r"(p) : "memory");
+
+	return loads ? (end - begin) * 1.0 / loads : 0;
+}
+
+// Build a chase over size bytes, warm it up for one lap and time it.
+// Return ns per load, or a negative value on error.
+fn double chase_measure(void *ptr, size_t size, size_t stride, int mode, size_t loads)
+{
+	void *start = chase_build(ptr, size, stride, mode);
+
+	if (!start)
+		return -1;
+
+	chase_run(start, size / stride);
+
+	return chase_run(start, loads);
+}
+
+// Sweep working-set sizes from min to max (doubling) and print ns per load.
+// Each point does at least loads loads, and at least two laps of the cycle.
+fn void chase_sweep(size_t min, size_t max, size_t stride, int mode, size_t loads)
+{
+	mmap_alloc_handle *handle = mmap_alloc(max);
+
+	if (!handle) {
+		pr("Unable to allocate %s for chase sweep", format_size(max));
+		return;
+	}
+
+	memfault(handle->map, handle->size);
+
+	pr_info("Pointer chase, stride %zu, %s:\n", stride, mode == CHASE_PAGE_LOCAL ? "page-local" : "cross-page");
+
+	for (size_t size = min; size && size <= max; size *= 2) {
+		size_t count = loads > 2 * (size / stride) ? loads : 2 * (size / stride);
+		double ns = chase_measure(handle->map, size, stride, mode, count);
+
+		if (ns < 0)
+			break;
+
+		pr_info("\t%12s: %8.2f ns/load\n", format_size(size), ns);
+	}
+
+	mmap_free(handle);
+}
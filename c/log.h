@@ -0,0 +1,415 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+
+#ifdef CONFIG_ASYNC_PRINTK
+
+//
+// Asynchronous printk backend
+//
+
+/*
+Opt in by defining CONFIG_ASYNC_PRINTK before including any header, kernel.h
+then routes printk and all pr_* macros here.
+
+Every thread formats its messages into its own SPSC byte ring, stamped with a
+global sequence number. A background thread merges all rings by sequence into
+stdout with large write() calls, so messages come out in the order they were
+logged and never interleave. The drainer never passes a sequence number that
+is reserved but not yet published, so a message logged after another one has
+been logged (e.g. after joining its thread) always comes out after it. Rings
+of exited threads are reused.
+
+The logger state has weak linkage, so all translation units of a program share
+one set of rings, one sequence and one drainer. If the drainer cannot be
+started, messages are drained synchronously by the logging thread instead.
+
+The rings are drained at exit, on fatal signals (unless the program installed
+its own handler) and at explicit printk_sync() calls.
+*/
+
+#define LOG_RING_SIZE KB(256)
+#define LOG_LINE_SIZE 1024 // Longer messages take a heap round trip
+#define LOG_OUT_SIZE KB(64) // Drained messages are batched into writes of this size
+#define LOG_DRAIN_MS 10
+
+// Records are padded to the header size, so headers never wrap in the ring.
+typedef struct __log_record {
+	u64 seq;
+	u64 len;
+} __log_record;
+
+#define __LOG_RECORD(len) (sizeof(__log_record) + ALIGN((len), sizeof(__log_record)))
+
+// Longer messages are truncated to fit the ring.
+#define LOG_MSG_MAX (LOG_RING_SIZE - sizeof(__log_record))
+
+// No sequence reserved by the owner of a ring.
+#define __LOG_SEQ_NONE UINT64_MAX
+
+typedef struct __log_ring {
+	u64 head __attribute__((aligned(64))); // Drainer
+	u64 tail __attribute__((aligned(64))); // Owner thread
+	u64 pending; // Lower bound of the sequence being appended, or __LOG_SEQ_NONE
+	bool used __attribute__((aligned(64))); // Owned by a live thread
+	struct __log_ring *next;
+	char buf[LOG_RING_SIZE];
+} __log_ring;
+
+// Defined once per program rather than once per translation unit.
+#define __log_shared __attribute__((weak))
+
+__log_shared __log_ring *__log_rings = NULL;
+__log_shared __thread __log_ring *__log_self = NULL;
+__log_shared pthread_key_t __log_key;
+__log_shared pthread_once_t __log_once = PTHREAD_ONCE_INIT;
+__log_shared pthread_mutex_t __log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+__log_shared pthread_cond_t __log_wake = PTHREAD_COND_INITIALIZER;
+__log_shared bool __log_draining = false;
+__log_shared bool __log_async = false; // The drainer thread is running
+__log_shared u64 __log_seq = 0;
+
+// Output batch of the drainer, only touched while holding __log_draining.
+__log_shared char __log_out_buf[LOG_OUT_SIZE];
+__log_shared size_t __log_out_len = 0;
+
+fn void __log_out_flush(void)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < __log_out_len) {
+		ret = write(STDOUT_FILENO, __log_out_buf + done, __log_out_len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		done += ret;
+	}
+
+	__log_out_len = 0;
+}
+
+fn void __log_out(const char *msg, size_t len)
+{
+	while (len) {
+		size_t chunk = LOG_OUT_SIZE - __log_out_len;
+
+		if (!chunk) {
+			__log_out_flush();
+			continue;
+		}
+
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(__log_out_buf + __log_out_len, msg, chunk);
+		__log_out_len += chunk;
+		msg += chunk;
+		len -= chunk;
+	}
+}
+
+// Get the oldest record of the ring logged before sequence until, or NULL.
+fn __log_record *__log_peek(__log_ring *ring, u64 until)
+{
+	u64 head = ring->head;
+	__log_record *rec;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	rec = (__log_record *) (ring->buf + (head & (LOG_RING_SIZE - 1)));
+	return rec->seq < until ? rec : NULL;
+}
+
+// Move the oldest record of the ring into the output batch.
+fn void __log_consume(__log_ring *ring, __log_record *rec)
+{
+	size_t off = (ring->head + sizeof(__log_record)) & (LOG_RING_SIZE - 1);
+	size_t first = rec->len < LOG_RING_SIZE - off ? rec->len : LOG_RING_SIZE - off;
+
+	__log_out(ring->buf + off, first);
+	__log_out(ring->buf, rec->len - first);
+
+	__atomic_store_n(&ring->head, ring->head + __LOG_RECORD(rec->len), __ATOMIC_RELEASE);
+}
+
+// Get the sequence below which every message has been published.
+// A writer announces a lower bound of its sequence before reserving it, so a
+// writer missed here can only reserve a sequence past the one read first.
+fn u64 __log_published(void)
+{
+	u64 until = __atomic_load_n(&__log_seq, __ATOMIC_SEQ_CST);
+
+	for (__log_ring *ring = __atomic_load_n(&__log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		u64 pending = __atomic_load_n(&ring->pending, __ATOMIC_SEQ_CST);
+
+		if (pending < until)
+			until = pending;
+	}
+
+	return until;
+}
+
+// Drain all published messages, merging the rings by sequence. It is
+// async-signal-safe. A forced drain from a crashing thread waits a bounded
+// time for the drainer, and gives up rather than race it on the rings.
+fn void __log_drain_all(bool forced)
+{
+	u64 until;
+	int spins = 0;
+
+	while (__atomic_test_and_set(&__log_draining, __ATOMIC_ACQUIRE)) {
+		if (forced && ++spins > 1000000)
+			return;
+		sched_yield();
+	}
+
+	until = __log_published();
+
+	for (;;) {
+		__log_ring *oldest = NULL;
+		__log_record *rec = NULL;
+		u64 next = UINT64_MAX; // Oldest sequence in any other ring
+
+		for (__log_ring *ring = __atomic_load_n(&__log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+			__log_record *head = __log_peek(ring, until);
+
+			if (!head)
+				continue;
+
+			if (!rec || head->seq < rec->seq) {
+				if (rec && rec->seq < next)
+					next = rec->seq;
+				oldest = ring;
+				rec = head;
+			} else if (head->seq < next) {
+				next = head->seq;
+			}
+		}
+
+		if (!oldest)
+			break;
+
+		// Take from the oldest ring until another one holds an older message
+		do {
+			__log_consume(oldest, rec);
+			rec = __log_peek(oldest, until);
+		} while (rec && rec->seq < next);
+	}
+
+	__log_out_flush();
+	__atomic_clear(&__log_draining, __ATOMIC_RELEASE);
+}
+
+fn void *__log_drainer(void *arg)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&__log_wake_lock);
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_DRAIN_MS * NSEC_PER_MSEC;
+		if (deadline.tv_nsec >= NSEC_PER_SEC) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= NSEC_PER_SEC;
+		}
+
+		pthread_cond_timedwait(&__log_wake, &__log_wake_lock, &deadline);
+		__log_drain_all(false);
+	}
+
+	return NULL;
+}
+
+// Flush all pending messages, and stdio stdout for output bypassing printk.
+fn void printk_sync(void)
+{
+	fflush(stdout);
+	__log_drain_all(false);
+}
+
+fn void __log_signal(int sig)
+{
+	__log_drain_all(true);
+	raise(sig);
+}
+
+// Hand the ring of an exiting thread over to the next new thread.
+fn void __log_ring_release(void *arg)
+{
+	__log_ring *ring = arg;
+
+	__log_self = NULL;
+	__atomic_store_n(&ring->used, false, __ATOMIC_RELEASE);
+}
+
+fn void __log_init(void)
+{
+	static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM };
+	struct sigaction act, old;
+	sigset_t all, prev;
+	pthread_t thread;
+
+	atexit(printk_sync);
+	pthread_key_create(&__log_key, __log_ring_release);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = __log_signal;
+	act.sa_flags = SA_RESETHAND | SA_NODEFER;
+
+	for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		// Leave handlers installed by the program alone
+		if (sigaction(signals[i], NULL, &old) || old.sa_handler != SIG_DFL)
+			continue;
+		sigaction(signals[i], &act, NULL);
+	}
+
+	// The drainer must not take signals meant for the program
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &prev);
+	if (pthread_create(&thread, NULL, __log_drainer, NULL))
+		thread = 0;
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+	if (thread) {
+		pthread_detach(thread);
+		__atomic_store_n(&__log_async, true, __ATOMIC_RELEASE);
+	}
+}
+
+// Get the ring of the calling thread, reusing the ring of an exited thread
+// or registering a new one on first use.
+fn __log_ring *__log_ring_self(void)
+{
+	__log_ring *ring;
+
+	if (likely(__log_self))
+		return __log_self;
+
+	pthread_once(&__log_once, __log_init);
+
+	for (ring = __atomic_load_n(&__log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		bool used = false;
+
+		if (!__atomic_load_n(&ring->used, __ATOMIC_RELAXED) &&
+		    __atomic_compare_exchange_n(&ring->used, &used, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!ring) {
+		ring = aligned_alloc(64, sizeof(__log_ring));
+		if (!ring)
+			return NULL;
+
+		ring->head = 0;
+		ring->tail = 0;
+		ring->pending = __LOG_SEQ_NONE;
+		ring->used = true;
+		ring->next = __atomic_load_n(&__log_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&__log_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	pthread_setspecific(__log_key, ring);
+	__log_self = ring;
+	return ring;
+}
+
+// Append a message as one record, waiting for the drainer to make room for
+// all of it, so that no partial message is ever published.
+fn void __log_append(__log_ring *ring, const char *msg, size_t len)
+{
+	u64 tail = ring->tail;
+	__log_record *rec;
+	size_t need, off, first;
+
+	bool cut = len > LOG_MSG_MAX && msg[len - 1] == '\n';
+
+	if (len > LOG_MSG_MAX)
+		len = LOG_MSG_MAX;
+
+	need = __LOG_RECORD(len);
+
+	while (LOG_RING_SIZE - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) < need) {
+		if (!__atomic_load_n(&__log_async, __ATOMIC_ACQUIRE)) {
+			__log_drain_all(false);
+			continue;
+		}
+
+		pthread_cond_signal(&__log_wake);
+		sched_yield();
+	}
+
+	// Hold back the drainer from here until the record is published
+	__atomic_store_n(&ring->pending, __atomic_load_n(&__log_seq, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+	rec = (__log_record *) (ring->buf + (tail & (LOG_RING_SIZE - 1)));
+	rec->seq = __atomic_fetch_add(&__log_seq, 1, __ATOMIC_SEQ_CST);
+	rec->len = len;
+
+	off = (tail + sizeof(__log_record)) & (LOG_RING_SIZE - 1);
+	first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+	memcpy(ring->buf + off, msg, first);
+	memcpy(ring->buf, msg + first, len - first);
+
+	// A truncated line still ends the line
+	if (cut)
+		ring->buf[(off + len - 1) & (LOG_RING_SIZE - 1)] = '\n';
+
+	tail += need;
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->pending, __LOG_SEQ_NONE, __ATOMIC_RELEASE);
+
+	if (!__atomic_load_n(&__log_async, __ATOMIC_ACQUIRE))
+		__log_drain_all(false);
+	else if (tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED) > LOG_RING_SIZE / 2)
+		pthread_cond_signal(&__log_wake);
+}
+
+__attribute__((format(printf, 1, 2)))
+fn int __async_printk(const char *fmt, ...)
+{
+	char line[LOG_LINE_SIZE];
+	char *msg = line;
+	__log_ring *ring = __log_ring_self();
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	if (len < 0)
+		return len;
+
+	if (len >= sizeof(line)) {
+		msg = malloc(len + 1);
+		if (msg) {
+			va_start(args, fmt);
+			vsnprintf(msg, len + 1, fmt, args);
+			va_end(args);
+		} else {
+			msg = line;
+			len = sizeof(line) - 1;
+		}
+	}
+
+	if (ring) {
+		__log_append(ring, msg, len);
+	} else {
+		fputs(msg, stdout);
+		fflush(stdout);
+	}
+
+	if (msg != line)
+		free(msg);
+
+	return len;
+}
+
+#endif /* CONFIG_ASYNC_PRINTK */
@@ -3,10 +3,31 @@
 #include "headers.h"
 #include "common.h"
 #include "kernel.h"
+#include "cpu.h"
 #include "random.h"
 #include "interactive.h"
 #include "printer.h"
 
+//
+// MMAP backing
+//
+
+#define MMAP_BACKING_4K 0
+#define MMAP_BACKING_THP 1 // MADV_HUGEPAGE accepted, faults may still use 4K pages
+#define MMAP_BACKING_HUGETLB_2M 2
+#define MMAP_BACKING_HUGETLB_1G 3
+
+fn const char *mmap_backing_name(int backing)
+{
+	switch (backing) {
+	case MMAP_BACKING_4K: return "4K";
+	case MMAP_BACKING_THP: return "THP";
+	case MMAP_BACKING_HUGETLB_2M: return "hugetlb 2M";
+	case MMAP_BACKING_HUGETLB_1G: return "hugetlb 1G";
+	default: return "unknown";
+	}
+}
+
 //
 // Private Anon MMAP
 //
@@ -14,6 +35,9 @@
 typedef struct mmap_alloc_handle {
 	void *map;
 	size_t size;
+	int backing; // MMAP_BACKING_* actually obtained
+	int policy; // MPOL_* placement requested via mmap_alloc_numa()
+	unsigned long nodemask;
 } mmap_alloc_handle;
 
 let mmap_alloc_handle default_mmap_alloc_handle = { 0 };
@@ -49,6 +73,76 @@ fn mmap_alloc_handle *mmap_alloc(size_t size)
 	return handle;
 }
 
+// Map private anon memory of size bytes aligned to align, trimming the excess.
+fn void *__mmap_aligned(size_t size, size_t align)
+{
+	u8 *raw, *map;
+	size_t head, tail;
+
+	raw = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return MAP_FAILED;
+
+	map = PTR_ALIGN(raw, align);
+	head = map - raw;
+	tail = align - head;
+
+	if (head)
+		munmap(raw, head);
+	if (tail)
+		munmap(map + size, tail);
+
+	return map;
+}
+
+// Allocate private anon memory backed by huge pages of pagesize (PMD_SIZE or PUD_SIZE).
+// The size is rounded up to pagesize. Backings are tried in order:
+// hugetlb pages of pagesize, THP on a pagesize-aligned range, then plain 4K pages.
+// The backing actually obtained is recorded in handle->backing.
+fn mmap_alloc_handle *mmap_alloc_huge(size_t size, size_t pagesize)
+{
+	mmap_alloc_handle *handle;
+	int shift, ret;
+
+	if (pagesize != PMD_SIZE && pagesize != PUD_SIZE) {
+		pr("Unsupported huge page size %s", format_size(pagesize));
+		return NULL;
+	}
+
+	handle = malloc(sizeof(mmap_alloc_handle));
+	if (!handle)
+		return NULL;
+
+	*handle = default_mmap_alloc_handle;
+
+	shift = pagesize == PUD_SIZE ? PUD_SHIFT : PMD_SHIFT;
+	handle->size = ALIGN(size, pagesize);
+	handle->map = mmap(NULL, handle->size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+	if (handle->map != MAP_FAILED) {
+		handle->backing = pagesize == PUD_SIZE ? MMAP_BACKING_HUGETLB_1G : MMAP_BACKING_HUGETLB_2M;
+		return handle;
+	}
+
+	pr("Map %s cannot use hugetlb %s pages, fallback to THP: errno %d", format_size(handle->size), format_size(pagesize), errno);
+
+	handle->map = __mmap_aligned(handle->size, pagesize);
+	if (handle->map == MAP_FAILED) {
+		mmap_free(handle);
+		return NULL;
+	}
+
+	ret = madvise(handle->map, handle->size, MADV_HUGEPAGE);
+	if (ret) {
+		pr("Map %s cannot enable THP, fallback to 4K: errno %d", format_size(handle->size), errno);
+		handle->backing = MMAP_BACKING_4K;
+	} else {
+		handle->backing = MMAP_BACKING_THP;
+	}
+
+	return handle;
+}
+
 //
 // Shared Device MMAP
 //
@@ -57,6 +151,8 @@ typedef struct mmap_device_handle {
 	int fd;
 	void *map;
 	size_t size;
+	int backing; // MMAP_BACKING_* actually obtained
+	bool sync; // MAP_SYNC obtained, flushed CPU caches are durable
 } mmap_device_handle;
 
 let mmap_device_handle default_mmap_device_handle = { 0 };
@@ -77,9 +173,14 @@ fn void munmap_device(mmap_device_handle *handle)
 	}
 }
 
+// Map a DAX device or file with MAP_SYNC, so that flushed stores are durable.
+// Where MAP_SYNC is not supported (page cache backed files, /dev/shm), it
+// falls back to a plain shared map and durability takes msync(). An existing
+// regular file shorter than size is extended.
 fn mmap_device_handle *mmap_device(char *dev, size_t size)
 {
 	mmap_device_handle *handle = malloc(sizeof(mmap_device_handle));
+	struct stat sb;
 	int ret = 0;
 
 	if (!handle)
@@ -94,8 +195,23 @@ fn mmap_device_handle *mmap_device(char *dev, size_t size)
 		return NULL;
 	}
 
+	if (!fstat(handle->fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size < size) {
+		if (ftruncate(handle->fd, size)) {
+			pr("Unable to extend %s to %s, map device failed: errno %d", dev, format_size(size), errno);
+			munmap_device(handle);
+			return NULL;
+		}
+	}
+
 	handle->size = size;
+	handle->sync = true;
 	handle->map = mmap(NULL, handle->size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, handle->fd, 0);
+	if (handle->map == MAP_FAILED && (errno == EOPNOTSUPP || errno == EINVAL)) {
+		pr_info("Map %s has no MAP_SYNC, fallback to msync() durability\n", dev);
+		handle->sync = false;
+		handle->map = mmap(NULL, handle->size, PROT_READ | PROT_WRITE, MAP_SHARED, handle->fd, 0);
+	}
+
 	if (handle->map == MAP_FAILED) {
 		pr("Unable to mmap %s, map device failed: errno %d", dev, errno);
 		munmap_device(handle);
@@ -105,6 +221,8 @@ fn mmap_device_handle *mmap_device(char *dev, size_t size)
 	ret = madvise(handle->map, handle->size, MADV_HUGEPAGE);
 	if (ret) {
 		pr("Map %s (%s) cannot enable THP: errno %d", dev, format_size(handle->size), errno);
+	} else {
+		handle->backing = MMAP_BACKING_THP;
 	}
 
 	return handle;
@@ -114,10 +232,17 @@ fn mmap_device_handle *mmap_device(char *dev, size_t size)
 // Shared File MMAP
 //
 
+#define MMAP_FILE_RDONLY BIT(0) // Open O_RDONLY and map PROT_READ
+#define MMAP_FILE_PRIVATE BIT(1) // MAP_PRIVATE, writes stay in this process
+#define MMAP_FILE_POPULATE BIT(2) // MAP_POPULATE, fault everything in at map time
+#define MMAP_FILE_NOHUGE BIT(3) // Skip MADV_HUGEPAGE
+
 typedef struct mmap_file_handle {
 	int fd;
 	void *map;
 	size_t size;
+	int backing; // MMAP_BACKING_* actually obtained
+	size_t slack; // Bytes between the page boundary and map for ranged maps
 } mmap_file_handle;
 
 let mmap_file_handle default_mmap_file_handle = { 0 };
@@ -125,7 +250,7 @@ let mmap_file_handle default_mmap_file_handle = { 0 };
 fn void munmap_file(mmap_file_handle *handle)
 {
 	if (handle && (handle->map != MAP_FAILED) && handle->size) {
-		munmap(handle->map, handle->size);
+		munmap(handle->map - handle->slack, handle->size + handle->slack);
 	}
 
 	if (handle && handle->fd >= 0) {
@@ -138,7 +263,25 @@ fn void munmap_file(mmap_file_handle *handle)
 	}
 }
 
-fn mmap_file_handle *mmap_file(char *file)
+fn int __mmap_file_open(char *file, int flags)
+{
+	// A private map may be written even when the file is not
+	return open(file, (flags & (MMAP_FILE_RDONLY | MMAP_FILE_PRIVATE)) ? O_RDONLY : O_RDWR);
+}
+
+fn int __mmap_file_prot(int flags)
+{
+	return (flags & MMAP_FILE_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+}
+
+fn int __mmap_file_type(int flags)
+{
+	return ((flags & MMAP_FILE_PRIVATE) ? MAP_PRIVATE : MAP_SHARED) | ((flags & MMAP_FILE_POPULATE) ? MAP_POPULATE : 0);
+}
+
+// Map size bytes of a file from offset with MMAP_FILE_* flags.
+// A size of 0 maps up to the end of the file. Offset needs no alignment.
+fn mmap_file_handle *mmap_file_range(char *file, off_t offset, size_t size, int flags)
 {
 	mmap_file_handle *handle = malloc(sizeof(mmap_file_handle));
 	struct stat sb;
@@ -149,7 +292,7 @@ fn mmap_file_handle *mmap_file(char *file)
 
 	*handle = default_mmap_file_handle;
 
-	handle->fd = open(file, O_RDWR);
+	handle->fd = __mmap_file_open(file, flags);
 	if (handle->fd < 0) {
 		pr("Unable to open %s, map file failed: errno %d", file, errno);
 		munmap_file(handle);
@@ -161,29 +304,190 @@ fn mmap_file_handle *mmap_file(char *file)
 		munmap_file(handle);
 		return NULL;
 	}
-	
-	handle->size = sb.st_size;
-	if (!handle->size) {
+
+	if (!sb.st_size) {
 		pr("Unable to mmap %s: File has zero size", file);
 		munmap_file(handle);
 		return NULL;
 	}
 
-	handle->map = mmap(NULL, handle->size, PROT_READ | PROT_WRITE, MAP_SHARED, handle->fd, 0);
+	if (offset >= sb.st_size) {
+		pr("Unable to mmap %s: Offset %lld is beyond %s", file, (long long) offset, format_size(sb.st_size));
+		munmap_file(handle);
+		return NULL;
+	}
+
+	if (!size || size > sb.st_size - offset)
+		size = sb.st_size - offset;
+
+	handle->size = size;
+	handle->slack = offset & (PAGE_SIZE - 1);
+
+	handle->map = mmap(NULL, handle->size + handle->slack, __mmap_file_prot(flags), __mmap_file_type(flags), handle->fd, offset - handle->slack);
 	if (handle->map == MAP_FAILED) {
 		pr("Unable to mmap %s, map file failed: errno %d", file, errno);
 		munmap_file(handle);
 		return NULL;
 	}
 
-	ret = madvise(handle->map, handle->size, MADV_HUGEPAGE);
+	handle->map += handle->slack;
+
+	if (flags & MMAP_FILE_NOHUGE)
+		return handle;
+
+	ret = madvise(handle->map - handle->slack, handle->size + handle->slack, MADV_HUGEPAGE);
 	if (ret) {
 		pr("Map %s (%s) cannot enable THP: errno %d", file, format_size(handle->size), errno);
+	} else {
+		handle->backing = MMAP_BACKING_THP;
 	}
 
 	return handle;
 }
 
+// Map a whole file with MMAP_FILE_* flags.
+fn mmap_file_handle *mmap_file_flags(char *file, int flags)
+{
+	return mmap_file_range(file, 0, 0, flags);
+}
+
+// Map a whole file read-write and shared.
+fn mmap_file_handle *mmap_file(char *file)
+{
+	return mmap_file_flags(file, 0);
+}
+
+//
+// Sliding File Window
+//
+
+// Walk a file of any size through fixed-size windows, keeping at most two
+// mapped: the current one, and the next one being read ahead. The window
+// left behind is dropped from the page tables, and from the page cache for
+// read-only scans, so the resident set stays bounded by the window size.
+typedef struct mmap_window {
+	int fd;
+	int flags;
+	off_t file_size;
+	size_t window;
+	off_t offset; // File offset of the current window
+	void *map; // Current window, NULL before the first mmap_window_next()
+	size_t size; // Valid bytes in the current window
+	void *ahead; // Next window, or NULL
+	size_t ahead_size;
+} mmap_window;
+
+fn void *__mmap_window_map(mmap_window *win, off_t offset, size_t *size)
+{
+	void *map;
+
+	*size = win->file_size - offset < win->window ? win->file_size - offset : win->window;
+
+	map = mmap(NULL, *size, __mmap_file_prot(win->flags), __mmap_file_type(win->flags), win->fd, offset);
+	if (map == MAP_FAILED) {
+		pr("Unable to mmap window at %lld: errno %d", (long long) offset, errno);
+		return NULL;
+	}
+
+	madvise(map, *size, MADV_SEQUENTIAL);
+	madvise(map, *size, MADV_WILLNEED);
+	return map;
+}
+
+fn void __mmap_window_drop(mmap_window *win, void *map, off_t offset, size_t size)
+{
+	if (!map)
+		return;
+
+	madvise(map, size, MADV_DONTNEED);
+	munmap(map, size);
+
+	// Only clean pages can leave the page cache
+	if (win->flags & MMAP_FILE_RDONLY)
+		posix_fadvise(win->fd, offset, size, POSIX_FADV_DONTNEED);
+}
+
+// Open a file for window walking with MMAP_FILE_* flags (MMAP_FILE_POPULATE
+// applies to each window). The window is rounded up to PAGE_SIZE.
+fn mmap_window *mmap_window_open(char *file, size_t window, int flags)
+{
+	mmap_window *win = malloc(sizeof(mmap_window));
+	struct stat sb;
+
+	if (!win)
+		return NULL;
+
+	memset(win, 0, sizeof(*win));
+	win->flags = flags;
+	win->window = ALIGN(window ? window : PMD_SIZE, PAGE_SIZE);
+	win->offset = -win->window;
+
+	win->fd = __mmap_file_open(file, flags);
+	if (win->fd < 0) {
+		pr("Unable to open %s, map window failed: errno %d", file, errno);
+		free(win);
+		return NULL;
+	}
+
+	if (fstat(win->fd, &sb)) {
+		close(win->fd);
+		free(win);
+		return NULL;
+	}
+
+	win->file_size = sb.st_size;
+	posix_fadvise(win->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return win;
+}
+
+// Move to the next window, return false past the end of the file.
+fn bool mmap_window_next(mmap_window *win)
+{
+	off_t next = win->offset + win->window;
+
+	__mmap_window_drop(win, win->map, win->offset, win->size);
+	win->map = NULL;
+	win->size = 0;
+
+	if (next >= win->file_size) {
+		win->offset = win->file_size;
+		return false;
+	}
+
+	if (win->ahead) {
+		win->map = win->ahead;
+		win->size = win->ahead_size;
+		win->ahead = NULL;
+	} else {
+		win->map = __mmap_window_map(win, next, &win->size);
+		if (!win->map)
+			return false;
+	}
+
+	win->offset = next;
+
+	// Read ahead the window after, the kernel fills it while we scan this one
+	next += win->window;
+	if (next < win->file_size)
+		win->ahead = __mmap_window_map(win, next, &win->ahead_size);
+
+	return true;
+}
+
+fn void mmap_window_close(mmap_window *win)
+{
+	if (!win)
+		return;
+
+	__mmap_window_drop(win, win->map, win->offset, win->size);
+	if (win->ahead)
+		munmap(win->ahead, win->ahead_size);
+
+	close(win->fd);
+	free(win);
+}
+
 //
 // Memory routines
 //
@@ -204,13 +508,166 @@ fn void memrandomize(void *ptr, size_t size)
 	prng_bytes(NULL, ptr, size);
 }
 
-// Exchange the content of the two memory regions.
-// This function will inherently generate bad result for overlapping regions.
-fn void memxchg(void *a, void *b, size_t size)
+//
+// Parallel memory routines
+//
+
+typedef struct __memparallel_task {
+	pthread_t thread;
+	int cpu;
+	u8 *ptr;
+	size_t size;
+	prng_state state;
+} __memparallel_task;
+
+// Pin the calling thread to the given CPU, negative CPU is a no-op.
+fn void __memparallel_pin(int cpu)
 {
-	if (a == b)
+	cpu_set_t set;
+
+	if (cpu < 0)
 		return;
 
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		pr("Unable to pin thread to CPU %d: errno %d", cpu, errno);
+	}
+}
+
+// Get the next CPU after cpu in the set, wrapping around, or -1 if empty.
+fn int __memparallel_next_cpu(const cpu_set_t *set, int cpu)
+{
+	for (int probe = 0; probe < CPU_SETSIZE; probe++) {
+		cpu = (cpu + 1) % CPU_SETSIZE;
+		if (CPU_ISSET(cpu, set))
+			return cpu;
+	}
+
+	return -1;
+}
+
+fn void *__memparallel_fault(void *arg)
+{
+	__memparallel_task *task = arg;
+
+	__memparallel_pin(task->cpu);
+	memfault(task->ptr, task->size);
+	return NULL;
+}
+
+fn void *__memparallel_randomize(void *arg)
+{
+	__memparallel_task *task = arg;
+
+	__memparallel_pin(task->cpu);
+	prng_bytes_jump(&task->state, task->ptr, task->size);
+	return NULL;
+}
+
+// Split a memory range into page-aligned chunks, one per worker.
+// Worker i is pinned to the i-th CPU in cpus (or the affinity mask if NULL),
+// and gets the given state advanced by i calls of prng_long_jump(). The given
+// state is then advanced past the states of all workers.
+// When nthreads is 0, one worker per CPU in the set is used.
+fn void __memparallel_run(void *ptr, size_t size, int nthreads, const cpu_set_t *cpus, prng_state *state, void *(*worker)(void *))
+{
+	__memparallel_task *tasks;
+	__memparallel_task single = { 0 };
+	prng_state next = { 0 };
+	cpu_set_t allowed;
+	size_t chunk, done = 0;
+	int ncpu, cpu = -1, ret;
+
+	if (cpus) {
+		allowed = *cpus;
+	} else if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		CPU_ZERO(&allowed);
+	}
+
+	ncpu = CPU_COUNT(&allowed);
+	if (nthreads <= 0)
+		nthreads = ncpu > 0 ? ncpu : 1;
+
+	tasks = calloc(nthreads, sizeof(__memparallel_task));
+	if (!tasks) {
+		pr("Unable to allocate %d workers, fallback to single thread", nthreads);
+		nthreads = 1;
+		tasks = &single;
+	}
+
+	chunk = ALIGN(__KERNEL_DIV_ROUND_UP(size, nthreads), PAGE_SIZE);
+
+	if (state)
+		next = *state;
+
+	for (int i = 0; i < nthreads; i++) {
+		__memparallel_task *task = &tasks[i];
+
+		// Pick the next allowed CPU, wrapping around when oversubscribed
+		task->cpu = cpu = __memparallel_next_cpu(&allowed, cpu);
+
+		task->ptr = (u8 *) ptr + done;
+		task->size = (size - done < chunk) ? size - done : chunk;
+		done += task->size;
+
+		// Earlier workers are already running on their copies
+		if (state) {
+			task->state = next;
+			prng_long_jump(&next);
+		}
+
+		ret = pthread_create(&task->thread, NULL, worker, task);
+		if (ret) {
+			pr("Unable to spawn worker %d, run it inline: errno %d", i, ret);
+			task->thread = 0;
+			task->cpu = -1;
+			worker(task);
+		}
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		if (tasks[i].thread)
+			pthread_join(tasks[i].thread, NULL);
+	}
+
+	if (state)
+		*state = next;
+
+	if (tasks != &single)
+		free(tasks);
+}
+
+// Fault in given memory range with nthreads pinned workers.
+// When nthreads is 0, one worker per CPU in the affinity mask is used.
+fn void memfault_parallel(void *ptr, size_t size, int nthreads)
+{
+	__memparallel_run(ptr, size, nthreads, NULL, NULL, __memparallel_fault);
+}
+
+// Fill given memory range with random bytes with nthreads pinned workers.
+// The caller may optionally provide a RNG state, or NULL to use global state.
+// Workers start prng_long_jump() apart, and each fills its chunk with
+// prng_bytes_jump(), whose lanes are prng_jump() apart. No two lanes of any
+// worker draw from overlapping subsequences of the state.
+// Output is reproducible for a given state and nthreads. The state is advanced
+// past all workers, so that the next call draws from fresh streams.
+fn void memrandomize_parallel(prng_state *state, void *ptr, size_t size, int nthreads)
+{
+	prng_state *current = state ? state : __prng_global();
+
+	__memparallel_run(ptr, size, nthreads, NULL, current, __memparallel_randomize);
+}
+
+//
+// Memory exchange
+//
+
+// Swaps of at least this size are worth bypassing the cache with memxchg_nt().
+#define MEMXCHG_NT_MIN MB(2)
+
+fn void __memxchg_scalar(void *a, void *b, size_t size)
+{
 	while (size >= sizeof(u64)) {
 		u64 *aa = a;
 		u64 *bb = b;
@@ -232,6 +689,197 @@ fn void memxchg(void *a, void *b, size_t size)
 	}
 }
 
+__attribute__((target("avx2")))
+fn void __memxchg_avx2(void *a, void *b, size_t size)
+{
+	__m256i x0, x1, y0, y1;
+
+	for (; size >= 64; size -= 64, a += 64, b += 64) {
+		x0 = _mm256_loadu_si256(a);
+		x1 = _mm256_loadu_si256(a + 32);
+		y0 = _mm256_loadu_si256(b);
+		y1 = _mm256_loadu_si256(b + 32);
+		_mm256_storeu_si256(a, y0);
+		_mm256_storeu_si256(a + 32, y1);
+		_mm256_storeu_si256(b, x0);
+		_mm256_storeu_si256(b + 32, x1);
+	}
+
+	if (size >= 32) {
+		x0 = _mm256_loadu_si256(a);
+		y0 = _mm256_loadu_si256(b);
+		_mm256_storeu_si256(a, y0);
+		_mm256_storeu_si256(b, x0);
+		size -= 32;
+		a += 32;
+		b += 32;
+	}
+
+	__memxchg_scalar(a, b, size);
+}
+
+__attribute__((target("avx512f")))
+fn void __memxchg_avx512(void *a, void *b, size_t size)
+{
+	__m512i x0, x1, y0, y1;
+
+	for (; size >= 128; size -= 128, a += 128, b += 128) {
+		x0 = _mm512_loadu_si512(a);
+		x1 = _mm512_loadu_si512(a + 64);
+		y0 = _mm512_loadu_si512(b);
+		y1 = _mm512_loadu_si512(b + 64);
+		_mm512_storeu_si512(a, y0);
+		_mm512_storeu_si512(a + 64, y1);
+		_mm512_storeu_si512(b, x0);
+		_mm512_storeu_si512(b + 64, x1);
+	}
+
+	if (size >= 64) {
+		x0 = _mm512_loadu_si512(a);
+		y0 = _mm512_loadu_si512(b);
+		_mm512_storeu_si512(a, y0);
+		_mm512_storeu_si512(b, x0);
+		size -= 64;
+		a += 64;
+		b += 64;
+	}
+
+	__memxchg_avx2(a, b, size);
+}
+
+// Streaming stores need both sides aligned, so only the body between the
+// aligned boundaries is streamed.
+__attribute__((target("avx2")))
+fn void __memxchg_nt_avx2(void *a, void *b, size_t size)
+{
+	__m256i x0, x1, y0, y1;
+
+	for (; size >= 64; size -= 64, a += 64, b += 64) {
+		x0 = _mm256_load_si256(a);
+		x1 = _mm256_load_si256(a + 32);
+		y0 = _mm256_load_si256(b);
+		y1 = _mm256_load_si256(b + 32);
+		_mm256_stream_si256(a, y0);
+		_mm256_stream_si256(a + 32, y1);
+		_mm256_stream_si256(b, x0);
+		_mm256_stream_si256(b + 32, x1);
+	}
+}
+
+__attribute__((target("avx512f")))
+fn void __memxchg_nt_avx512(void *a, void *b, size_t size)
+{
+	__m512i x, y;
+
+	for (; size >= 64; size -= 64, a += 64, b += 64) {
+		x = _mm512_load_si512(a);
+		y = _mm512_load_si512(b);
+		_mm512_stream_si512(a, y);
+		_mm512_stream_si512(b, x);
+	}
+}
+
+fn void __memxchg_nt_sse2(void *a, void *b, size_t size)
+{
+	__m128i x0, x1, y0, y1;
+
+	for (; size >= 32; size -= 32, a += 32, b += 32) {
+		x0 = _mm_load_si128(a);
+		x1 = _mm_load_si128(a + 16);
+		y0 = _mm_load_si128(b);
+		y1 = _mm_load_si128(b + 16);
+		_mm_stream_si128(a, y0);
+		_mm_stream_si128(a + 16, y1);
+		_mm_stream_si128(b, x0);
+		_mm_stream_si128(b + 16, x1);
+	}
+}
+
+fn void (*__resolve_memxchg(void))(void *, void *, size_t)
+{
+	switch (__cpu_vector_level()) {
+	case __CPU_VECTOR_AVX512: return __memxchg_avx512;
+	case __CPU_VECTOR_AVX2: return __memxchg_avx2;
+	default: return __memxchg_scalar;
+	}
+}
+
+fn void (*__resolve_memxchg_nt(void))(void *, void *, size_t)
+{
+	switch (__cpu_vector_level()) {
+	case __CPU_VECTOR_AVX512: return __memxchg_nt_avx512;
+	case __CPU_VECTOR_AVX2: return __memxchg_nt_avx2;
+	default: return __memxchg_nt_sse2;
+	}
+}
+
+fn void __memxchg(void *a, void *b, size_t size) __attribute__((ifunc("__resolve_memxchg")));
+
+// Size must be a multiple of 64, and a and b aligned to 64.
+fn void __memxchg_nt(void *a, void *b, size_t size) __attribute__((ifunc("__resolve_memxchg_nt")));
+
+// Declare a memxchg of given fixed size, the compiler picks the moves.
+#define memxchg_fixed_decl(size) \
+fn void memxchg_##size(void *a, void *b) \
+{ \
+	u8 ta[size], tb[size]; \
+	__builtin_memcpy(ta, a, size); \
+	__builtin_memcpy(tb, b, size); \
+	__builtin_memcpy(a, tb, size); \
+	__builtin_memcpy(b, ta, size); \
+}
+
+memxchg_fixed_decl(8)
+memxchg_fixed_decl(16)
+memxchg_fixed_decl(32)
+memxchg_fixed_decl(64)
+memxchg_fixed_decl(128)
+
+// Exchange the content of the two memory regions.
+// This function will inherently generate bad result for overlapping regions.
+fn void memxchg(void *a, void *b, size_t size)
+{
+	if (a == b)
+		return;
+
+	// Folded away when size is a compile-time constant
+	switch (size) {
+	case 8: return memxchg_8(a, b);
+	case 16: return memxchg_16(a, b);
+	case 32: return memxchg_32(a, b);
+	case 64: return memxchg_64(a, b);
+	case 128: return memxchg_128(a, b);
+	default: break;
+	}
+
+	__memxchg(a, b, size);
+}
+
+// Exchange the content of the two memory regions, bypassing the cache.
+// Worth it from MEMXCHG_NT_MIN bytes, when the regions will not be read soon.
+// The streamed body requires a and b to share their offset within 64 bytes,
+// other regions take the cached path.
+fn void memxchg_nt(void *a, void *b, size_t size)
+{
+	size_t head, body;
+
+	if (a == b)
+		return;
+
+	if ((((unsigned long) a ^ (unsigned long) b) & 63) || size < 128) {
+		__memxchg(a, b, size);
+		return;
+	}
+
+	head = ALIGN((unsigned long) a, 64) - (unsigned long) a;
+	body = ALIGN_DOWN(size - head, 64);
+
+	__memxchg(a, b, head);
+	__memxchg_nt(a + head, b + head, body);
+	_mm_sfence();
+	__memxchg(a + head + body, b + head + body, size - head - body);
+}
+
 // Declare a memshuffle operation on given type with given name suffix.
 #define memshuffle_decl(name, type) \
 fn void memshuffle_##name(type *list, size_t len) \
@@ -239,7 +887,7 @@ fn void memshuffle_##name(type *list, size_t len) \
 	size_t j; \
 	type tmp; \
 	while(len) { \
-		j = prng_u64(NULL) % len; \
+		j = prng_below(NULL, len); \
 		len--; \
 		tmp = list[j]; \
 		list[j] = list[len]; \
@@ -270,7 +918,7 @@ fn void memshuffle(void *ptr, size_t elemsz, size_t elemcnt)
 	}
 
 	while(elemcnt) {
-		j = prng_u64(NULL) % elemcnt;
+		j = prng_below(NULL, elemcnt);
 		elemcnt--;
 		memxchg(ptr + elemsz * elemcnt, ptr + elemsz * j, elemsz);
 	}
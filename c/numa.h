@@ -0,0 +1,259 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// NUMA syscalls
+//
+
+// Node masks are a single unsigned long, so up to 64 nodes are addressable.
+#define NUMA_MAX_NODES (sizeof(unsigned long) * 8)
+
+// The kernel drops the last bit of maxnode, pass one more than the mask width.
+#define __NUMA_MAXNODE (NUMA_MAX_NODES + 1)
+
+fn long numa_mbind(void *addr, size_t len, int mode, unsigned long nodemask, unsigned int flags)
+{
+	return syscall(SYS_mbind, addr, len, mode, mode == MPOL_DEFAULT ? NULL : &nodemask, __NUMA_MAXNODE, flags);
+}
+
+// Set the NUMA policy of the calling thread.
+fn long numa_set_mempolicy(int mode, unsigned long nodemask)
+{
+	return syscall(SYS_set_mempolicy, mode, mode == MPOL_DEFAULT ? NULL : &nodemask, __NUMA_MAXNODE);
+}
+
+// Query the node of each page, status receives node id or negative errno.
+fn long numa_move_pages(unsigned long count, void **pages, int *status)
+{
+	return syscall(SYS_move_pages, 0, count, pages, NULL, status, 0);
+}
+
+//
+// NUMA topology
+//
+
+// Parse a sysfs list such as "0-3,8,10-11" into a CPU set.
+// Return the number of entries parsed, or -1 if the file cannot be read.
+fn int __numa_parse_list(char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	char *ptr = buf;
+	int count = 0;
+	FILE *file = fopen(path, "r");
+
+	if (!file)
+		return -1;
+
+	if (!fgets(buf, sizeof(buf), file)) {
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+
+	while (*ptr && *ptr != '\n') {
+		char *endp;
+		long lo, hi;
+
+		lo = strtol(ptr, &endp, 10);
+		if (endp == ptr)
+			break;
+
+		hi = lo;
+		ptr = endp;
+		if (*ptr == '-') {
+			hi = strtol(ptr + 1, &endp, 10);
+			ptr = endp;
+		}
+
+		for (long i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+			CPU_SET(i, set);
+			count++;
+		}
+
+		if (*ptr == ',')
+			ptr++;
+	}
+
+	return count;
+}
+
+// Get the mask of online NUMA nodes, node 0 only if unknown.
+fn unsigned long numa_online_nodes(void)
+{
+	cpu_set_t set;
+	unsigned long mask = 0;
+
+	CPU_ZERO(&set);
+	if (__numa_parse_list("/sys/devices/system/node/online", &set) <= 0)
+		return 1;
+
+	for (int node = 0; node < NUMA_MAX_NODES; node++) {
+		if (CPU_ISSET(node, &set))
+			mask |= BIT(node);
+	}
+
+	return mask;
+}
+
+// Add the CPUs of all nodes in nodemask into the given set.
+// Return the number of CPUs added.
+fn int numa_node_cpus(unsigned long nodemask, cpu_set_t *set)
+{
+	char path[64];
+	int count = 0;
+	int ret;
+
+	for (int node = 0; node < NUMA_MAX_NODES; node++) {
+		if (!(nodemask & BIT(node)))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		ret = __numa_parse_list(path, set);
+		if (ret > 0)
+			count += ret;
+	}
+
+	return count;
+}
+
+//
+// NUMA-aware Private Anon MMAP
+//
+
+// Count resident pages of a range per node.
+// nodes[i] receives the page count on node i, for i < NUMA_MAX_NODES.
+// Return the number of pages not present (or not queryable).
+fn size_t numa_query_pages(void *ptr, size_t size, size_t nodes[NUMA_MAX_NODES])
+{
+	const unsigned long batch = 4096;
+	void **pages = malloc(batch * sizeof(void *));
+	int *status = malloc(batch * sizeof(int));
+	size_t missing = 0;
+	int failed = 0;
+	u8 *base = PTR_ALIGN_DOWN((u8 *) ptr, PAGE_SIZE);
+	u8 *end = (u8 *) ptr + size;
+
+	memset(nodes, 0, NUMA_MAX_NODES * sizeof(size_t));
+
+	if (!pages || !status) {
+		free(pages);
+		free(status);
+		return __KERNEL_DIV_ROUND_UP(end - base, PAGE_SIZE);
+	}
+
+	while (base < end) {
+		unsigned long count = 0;
+
+		while (count < batch && base < end) {
+			pages[count++] = base;
+			base += PAGE_SIZE;
+		}
+
+		if (numa_move_pages(count, pages, status)) {
+			if (!failed++)
+				pr("Unable to query nodes of %s at %p: errno %d", format_size(end - (u8 *) ptr), ptr, errno);
+			missing += count;
+			continue;
+		}
+
+		for (unsigned long i = 0; i < count; i++) {
+			if (status[i] >= 0 && status[i] < NUMA_MAX_NODES)
+				nodes[status[i]]++;
+			else
+				missing++;
+		}
+	}
+
+	free(pages);
+	free(status);
+
+	return missing;
+}
+
+// Warn when faulted pages landed outside the requested nodes, a benchmark
+// would otherwise measure the wrong placement without telling.
+fn void __numa_check_placement(mmap_alloc_handle *handle)
+{
+	size_t nodes[NUMA_MAX_NODES];
+	size_t outside = 0;
+
+	if (handle->policy == MPOL_DEFAULT)
+		return;
+
+	numa_query_pages(handle->map, handle->size, nodes);
+
+	for (int node = 0; node < NUMA_MAX_NODES; node++) {
+		if (!(handle->nodemask & BIT(node)))
+			outside += nodes[node];
+	}
+
+	if (outside)
+		pr("Map %s has %s outside nodes 0x%lx (policy %d)", format_size(handle->size), format_size(outside * PAGE_SIZE), handle->nodemask, handle->policy);
+}
+
+// Allocate private anon memory placed by the given policy and node mask.
+// policy is one of MPOL_BIND, MPOL_INTERLEAVE, MPOL_PREFERRED or MPOL_DEFAULT.
+// When prefault is set, the range is faulted in by threads pinned to the CPUs
+// of the target nodes, so first-touch placement matches the policy as well.
+fn mmap_alloc_handle *mmap_alloc_numa(size_t size, int policy, unsigned long nodemask, bool prefault)
+{
+	mmap_alloc_handle *handle = mmap_alloc(size);
+	cpu_set_t cpus, allowed;
+	long ret;
+
+	if (!handle)
+		return NULL;
+
+	handle->policy = policy;
+	handle->nodemask = nodemask;
+
+	ret = numa_mbind(handle->map, handle->size, policy, nodemask, 0);
+	if (ret) {
+		pr("Unable to mbind %s to nodes 0x%lx (policy %d): errno %d", format_size(size), nodemask, policy, errno);
+		mmap_free(handle);
+		return NULL;
+	}
+
+	if (!prefault)
+		return handle;
+
+	// Interleaved pages are placed by the policy, any CPU can touch them
+	CPU_ZERO(&cpus);
+	if (policy == MPOL_BIND || policy == MPOL_PREFERRED) {
+		if (numa_node_cpus(nodemask, &cpus) && !sched_getaffinity(0, sizeof(allowed), &allowed))
+			CPU_AND(&cpus, &cpus, &allowed);
+	}
+
+	// Memory-only nodes have no CPU to run on, fault from anywhere
+	if ((policy == MPOL_BIND || policy == MPOL_PREFERRED) && !CPU_COUNT(&cpus))
+		pr("Nodes 0x%lx have no CPU we may run on, prefault %s from any CPU", nodemask, format_size(size));
+
+	__memparallel_run(handle->map, handle->size, 0, CPU_COUNT(&cpus) ? &cpus : NULL, NULL, __memparallel_fault);
+
+	__numa_check_placement(handle);
+	return handle;
+}
+
+// Print where the pages of an allocation actually landed.
+fn void mmap_numa_report(mmap_alloc_handle *handle)
+{
+	size_t nodes[NUMA_MAX_NODES];
+	size_t missing = numa_query_pages(handle->map, handle->size, nodes);
+
+	pr_info("Map %p (%s) policy %d nodes 0x%lx:\n", handle->map, format_size(handle->size), handle->policy, handle->nodemask);
+
+	for (int node = 0; node < NUMA_MAX_NODES; node++) {
+		if (nodes[node])
+			pr_info("\tnode %d: %s\n", node, format_size(nodes[node] * PAGE_SIZE));
+	}
+
+	if (missing)
+		pr_info("\tnot present: %s\n", format_size(missing * PAGE_SIZE));
+}
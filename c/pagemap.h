@@ -0,0 +1,244 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Documentation/admin-guide/mm/pagemap.rst
+//
+
+#define PM_PFRAME_MASK (BIT(55) - 1)
+#define PM_SOFT_DIRTY BIT(55)
+#define PM_MMAP_EXCLUSIVE BIT(56)
+#define PM_FILE BIT(61)
+#define PM_SWAP BIT(62)
+#define PM_PRESENT BIT(63)
+
+#define KPF_COMPOUND_HEAD 15
+#define KPF_COMPOUND_TAIL 16
+#define KPF_HUGE 17
+#define KPF_THP 22
+
+//
+// Pagemap reader
+//
+
+// Bucket k counts physically contiguous runs of [2^k, 2^(k+1)) pages.
+#define PAGEMAP_CONTIG_BUCKETS 20
+
+// Pagemap entries read per pread, 512 KiB worth of entries.
+#define PAGEMAP_BATCH (KB(64))
+
+typedef struct pagemap_stats {
+	size_t pages; // Pages scanned
+	size_t present;
+	size_t swapped;
+	size_t file; // File-backed or shared anon
+	size_t pfn; // Present pages with a known PFN (needs CAP_SYS_ADMIN)
+	size_t thp; // Needs kpageflags
+	size_t hugetlb; // Needs kpageflags
+	bool kpageflags; // THP and hugetlb counts are valid
+	size_t contig[PAGEMAP_CONTIG_BUCKETS];
+} pagemap_stats;
+
+let pagemap_stats default_pagemap_stats = { 0 };
+
+// Read exactly len bytes at off, return false on error or EOF.
+fn bool __pagemap_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, off);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return true;
+}
+
+// Account a physically contiguous run into the histogram.
+fn void __pagemap_contig(pagemap_stats *stats, size_t run)
+{
+	int bucket;
+
+	if (!run)
+		return;
+
+	bucket = 63 - __builtin_clzll(run);
+	if (bucket >= PAGEMAP_CONTIG_BUCKETS)
+		bucket = PAGEMAP_CONTIG_BUCKETS - 1;
+
+	stats->contig[bucket]++;
+}
+
+// Join a batch of pagemap entries against kpageflags.
+// Each physically contiguous segment costs a single pread.
+fn void __pagemap_kflags(int kf, u64 *entries, size_t count, u64 *flags, pagemap_stats *stats)
+{
+	size_t i = 0;
+
+	while (i < count) {
+		u64 pfn = entries[i] & PM_PFRAME_MASK;
+		size_t len = 1;
+
+		if (!(entries[i] & PM_PRESENT) || !pfn) {
+			i++;
+			continue;
+		}
+
+		while (i + len < count && (entries[i + len] & PM_PRESENT) &&
+		       (entries[i + len] & PM_PFRAME_MASK) == pfn + len)
+			len++;
+
+		if (__pagemap_pread(kf, flags, len * sizeof(u64), pfn * sizeof(u64))) {
+			for (size_t j = 0; j < len; j++) {
+				if (flags[j] & BIT(KPF_THP))
+					stats->thp++;
+				if (flags[j] & BIT(KPF_HUGE))
+					stats->hugetlb++;
+			}
+		}
+
+		i += len;
+	}
+}
+
+// Scan the page mapping of the given virtual range.
+// When kflags is set, /proc/kpageflags is consulted for THP and hugetlb
+// counts, which requires root; stats->kpageflags tells if it was used.
+// Return 0 on success, -1 if the pagemap cannot be read.
+fn int pagemap_scan(void *ptr, size_t size, pagemap_stats *stats, bool kflags)
+{
+	u64 vpn = (unsigned long) ptr >> PAGE_SHIFT;
+	u64 end = ALIGN((unsigned long) ptr + size, PAGE_SIZE) >> PAGE_SHIFT;
+	u64 *entries = NULL, *flags = NULL;
+	u64 last = 0;
+	size_t run = 0;
+	int pm, kf = -1;
+	int ret = -1;
+
+	*stats = default_pagemap_stats;
+
+	pm = open("/proc/self/pagemap", O_RDONLY);
+	if (pm < 0) {
+		pr("Unable to open /proc/self/pagemap: errno %d", errno);
+		return -1;
+	}
+
+	if (kflags) {
+		kf = open("/proc/kpageflags", O_RDONLY);
+		if (kf < 0)
+			pr("Unable to open /proc/kpageflags, THP and hugetlb are not counted: errno %d", errno);
+	}
+
+	entries = malloc(PAGEMAP_BATCH * sizeof(u64));
+	if (kf >= 0)
+		flags = malloc(PAGEMAP_BATCH * sizeof(u64));
+
+	if (!entries || (kf >= 0 && !flags))
+		goto out;
+
+	stats->kpageflags = kf >= 0;
+
+	while (vpn < end) {
+		size_t count = end - vpn < PAGEMAP_BATCH ? end - vpn : PAGEMAP_BATCH;
+
+		if (!__pagemap_pread(pm, entries, count * sizeof(u64), vpn * sizeof(u64))) {
+			pr("Unable to read pagemap at 0x%llx: errno %d", vpn << PAGE_SHIFT, errno);
+			goto out;
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			u64 entry = entries[i];
+			u64 pfn = entry & PM_PFRAME_MASK;
+
+			stats->pages++;
+
+			if (entry & PM_FILE)
+				stats->file++;
+
+			if (!(entry & PM_PRESENT)) {
+				if (entry & PM_SWAP)
+					stats->swapped++;
+
+				__pagemap_contig(stats, run);
+				run = 0;
+				continue;
+			}
+
+			stats->present++;
+
+			if (!pfn) {
+				__pagemap_contig(stats, run);
+				run = 0;
+				continue;
+			}
+
+			stats->pfn++;
+
+			if (run && pfn == last + 1) {
+				run++;
+			} else {
+				__pagemap_contig(stats, run);
+				run = 1;
+			}
+
+			last = pfn;
+		}
+
+		if (kf >= 0)
+			__pagemap_kflags(kf, entries, count, flags, stats);
+
+		vpn += count;
+	}
+
+	__pagemap_contig(stats, run);
+	ret = 0;
+
+out:
+	free(entries);
+	free(flags);
+	if (kf >= 0)
+		close(kf);
+	close(pm);
+
+	return ret;
+}
+
+// Scan any mmap_*_handle, they all expose map and size.
+#define mmap_pagemap_scan(handle, stats, kflags) pagemap_scan((handle)->map, (handle)->size, stats, kflags)
+
+// Print the page mapping statistics.
+fn void pagemap_report(pagemap_stats *stats)
+{
+	pr_info("Pagemap: %s scanned, %s present, %s swapped, %s file\n",
+		format_size(stats->pages * PAGE_SIZE), format_size(stats->present * PAGE_SIZE),
+		format_size(stats->swapped * PAGE_SIZE), format_size(stats->file * PAGE_SIZE));
+
+	if (stats->kpageflags) {
+		pr_info("\tTHP: %s, hugetlb: %s\n",
+			format_size(stats->thp * PAGE_SIZE), format_size(stats->hugetlb * PAGE_SIZE));
+	}
+
+	if (!stats->pfn) {
+		pr_info("\tPFN unavailable (needs CAP_SYS_ADMIN)\n");
+		return;
+	}
+
+	pr_info("\tPhysically contiguous runs:\n");
+	for (int i = 0; i < PAGEMAP_CONTIG_BUCKETS; i++) {
+		if (stats->contig[i])
+			pr_info("\t\t>= %s: %zu\n", format_size(BIT(i) * PAGE_SIZE), stats->contig[i]);
+	}
+}
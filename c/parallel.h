@@ -0,0 +1,590 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Work-stealing deque
+//
+
+// Slots of each deque, a full deque runs new work inline instead.
+#define WSQ_SIZE 1024
+
+typedef void (*parallel_fn)(void *ptr, size_t size, void *arg);
+
+typedef struct __parallel_job {
+	parallel_fn func;
+	void *arg;
+	size_t grain;
+	unsigned long base; // Split points are at base + k * grain
+	size_t pending; // Bytes not yet processed
+} __parallel_job;
+
+// A task is a byte range of a job, split lazily when it gets executed.
+typedef struct wsq_task {
+	__parallel_job *job;
+	u8 *ptr;
+	size_t size;
+} wsq_task;
+
+// Chase-Lev deque. The owner pushes and pops at the bottom, thieves steal
+// from the top. Tasks are stored by value, a thief that reads a slot being
+// overwritten is bound to lose the CAS on top and discards what it read.
+typedef struct wsq {
+	s64 top __attribute__((aligned(64)));
+	s64 bottom __attribute__((aligned(64)));
+	wsq_task slots[WSQ_SIZE] __attribute__((aligned(64)));
+} wsq;
+
+fn bool wsq_push(wsq *q, const wsq_task *task)
+{
+	s64 b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+	s64 t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= WSQ_SIZE)
+		return false;
+
+	q->slots[b & (WSQ_SIZE - 1)] = *task;
+	__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+fn bool wsq_pop(wsq *q, wsq_task *task)
+{
+	s64 b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+	s64 t;
+	bool ok = true;
+
+	__atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		// Empty
+		__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	*task = q->slots[b & (WSQ_SIZE - 1)];
+
+	if (t == b) {
+		// Last task, race the thieves for it
+		ok = __atomic_compare_exchange_n(&q->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return ok;
+}
+
+fn bool wsq_steal(wsq *q, wsq_task *task)
+{
+	s64 t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+	s64 b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return false;
+
+	*task = q->slots[t & (WSQ_SIZE - 1)];
+	return __atomic_compare_exchange_n(&q->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+//
+// Work-stealing thread pool
+//
+
+typedef struct __workpool_worker {
+	wsq queue;
+	struct workpool *pool;
+	pthread_t thread;
+	int id;
+	int cpu;
+	u64 seed; // Victim selection
+} __workpool_worker;
+
+// Worker 0 is whichever thread submits from outside the pool, the others
+// are pinned pool threads. Idle workers spin while a job is active, and
+// sleep otherwise.
+typedef struct workpool {
+	__workpool_worker *workers;
+	int nr;
+	u32 active;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_mutex_t submit; // Serializes outside submitters on worker 0
+} workpool;
+
+mut __thread __workpool_worker *__workpool_self = NULL;
+
+// Run a task, splitting off the upper half onto our deque until it fits a grain.
+// Split points are whole grains away from the page aligned job base, so pieces
+// are multiples of the grain and no page is shared, whatever the grain is.
+fn void __workpool_execute(__workpool_worker *self, wsq_task task)
+{
+	__parallel_job *job = task.job;
+
+	while (task.size > job->grain) {
+		unsigned long start = (unsigned long) task.ptr;
+		unsigned long first = (start - job->base) / job->grain + 1;
+		unsigned long last = (start + task.size - 1 - job->base) / job->grain;
+		unsigned long mid;
+		wsq_task upper;
+
+		// No split point strictly inside the task
+		if (first > last)
+			break;
+
+		mid = job->base + (first + last) / 2 * job->grain;
+
+		upper.job = job;
+		upper.ptr = (u8 *) mid;
+		upper.size = start + task.size - mid;
+
+		if (!wsq_push(&self->queue, &upper))
+			break;
+
+		task.size = mid - start;
+	}
+
+	job->func(task.ptr, task.size, job->arg);
+	__atomic_sub_fetch(&job->pending, task.size, __ATOMIC_RELEASE);
+}
+
+// Find a task, from our own deque first, then from a random victim.
+fn bool __workpool_find(__workpool_worker *self, wsq_task *task)
+{
+	workpool *pool = self->pool;
+
+	if (wsq_pop(&self->queue, task))
+		return true;
+
+	for (int i = 0; i < pool->nr; i++) {
+		__workpool_worker *victim;
+
+		self->seed = self->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		victim = &pool->workers[(self->seed >> 33) % pool->nr];
+
+		if (victim != self && wsq_steal(&victim->queue, task))
+			return true;
+	}
+
+	return false;
+}
+
+fn void *__workpool_thread(void *arg)
+{
+	__workpool_worker *self = arg;
+	workpool *pool = self->pool;
+	wsq_task task;
+
+	__memparallel_pin(self->cpu);
+	__workpool_self = self;
+
+	for (;;) {
+		if (__workpool_find(self, &task)) {
+			__workpool_execute(self, task);
+			continue;
+		}
+
+		if (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->active && !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	return NULL;
+}
+
+// Start a pool of nthreads workers (the submitting thread counts as one),
+// pinned round-robin to the CPUs in cpus, or the affinity mask if NULL.
+// When nthreads is 0, one worker per CPU in the set is used.
+fn int workpool_init(workpool *pool, int nthreads, const cpu_set_t *cpus)
+{
+	cpu_set_t allowed;
+	int ncpu, cpu = -1, ret;
+
+	if (cpus) {
+		allowed = *cpus;
+	} else if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		CPU_ZERO(&allowed);
+	}
+
+	ncpu = CPU_COUNT(&allowed);
+	if (nthreads <= 0)
+		nthreads = ncpu > 0 ? ncpu : 1;
+
+	pool->workers = aligned_alloc(64, ALIGN(nthreads * sizeof(__workpool_worker), 64));
+	if (!pool->workers) {
+		pr("Unable to allocate %d workers", nthreads);
+		return -1;
+	}
+
+	pool->nr = nthreads;
+	pool->active = 0;
+	pool->stop = false;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_mutex_init(&pool->submit, NULL);
+
+	for (int i = 0; i < nthreads; i++) {
+		__workpool_worker *worker = &pool->workers[i];
+
+		worker->queue.top = 0;
+		worker->queue.bottom = 0;
+		worker->pool = pool;
+		worker->thread = 0;
+		worker->id = i;
+		worker->cpu = cpu = __memparallel_next_cpu(&allowed, cpu);
+		worker->seed = i + 1;
+	}
+
+	for (int i = 1; i < nthreads; i++) {
+		__workpool_worker *worker = &pool->workers[i];
+
+		ret = pthread_create(&worker->thread, NULL, __workpool_thread, worker);
+		if (ret) {
+			// Work queued here is still reachable by stealing
+			pr("Unable to spawn worker %d: errno %d", i, ret);
+			worker->thread = 0;
+		}
+	}
+
+	return 0;
+}
+
+fn void workpool_destroy(workpool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->stop, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->nr; i++) {
+		if (pool->workers[i].thread)
+			pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->submit);
+	free(pool->workers);
+	pool->workers = NULL;
+	pool->nr = 0;
+}
+
+// Pages a grain is made of, huge pages once it is large enough to have them.
+fn size_t __workpool_grain_align(size_t grain)
+{
+	return grain >= PMD_SIZE ? PMD_SIZE : PAGE_SIZE;
+}
+
+// Pick a grain for a range: about 8 tasks per worker, in whole pages, in
+// whole huge pages once the range is large enough to have them.
+fn size_t __workpool_grain(workpool *pool, size_t size, size_t grain)
+{
+	if (!grain)
+		grain = size / ((size_t) pool->nr * 8);
+
+	return grain ? ALIGN(grain, __workpool_grain_align(grain)) : PAGE_SIZE;
+}
+
+// Call func on pieces covering [ptr, ptr + size) on all workers of the pool,
+// return when all pieces are done. Pieces start at whole grains from ptr
+// rounded down to its page, or huge page for grains of at least PMD_SIZE.
+// A grain of 0 picks one, a grain is rounded up to PAGE_SIZE, or to PMD_SIZE
+// once it is at least that large.
+// It may be nested, func may call workpool_for() on the same pool.
+fn void workpool_for(workpool *pool, void *ptr, size_t size, size_t grain, parallel_fn func, void *arg)
+{
+	__workpool_worker *prev = __workpool_self;
+	__workpool_worker *self = prev;
+	bool outside = !self || self->pool != pool;
+	size_t step = __workpool_grain(pool, size, grain);
+	__parallel_job job = { func, arg, step, ALIGN_DOWN((unsigned long) ptr, __workpool_grain_align(step)), size };
+	wsq_task task = { &job, ptr, size };
+
+	if (!size)
+		return;
+
+	if (outside) {
+		pthread_mutex_lock(&pool->submit);
+		self = &pool->workers[0];
+		__workpool_self = self;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->active, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	__workpool_execute(self, task);
+
+	// Help out until every piece of our job is done
+	while (__atomic_load_n(&job.pending, __ATOMIC_ACQUIRE)) {
+		if (__workpool_find(self, &task))
+			__workpool_execute(self, task);
+		else
+			sched_yield();
+	}
+
+	__atomic_sub_fetch(&pool->active, 1, __ATOMIC_RELEASE);
+
+	if (outside) {
+		__workpool_self = prev; // We may be a worker of another pool
+		pthread_mutex_unlock(&pool->submit);
+	}
+}
+
+mut workpool __workpool_global;
+mut pthread_once_t __workpool_global_once = PTHREAD_ONCE_INIT;
+
+fn void __workpool_global_init(void)
+{
+	if (workpool_init(&__workpool_global, 0, NULL))
+		pr("Unable to start global worker pool");
+}
+
+// The global pool, one pinned worker per CPU in the affinity mask at first use.
+fn workpool *workpool_get(void)
+{
+	pthread_once(&__workpool_global_once, __workpool_global_init);
+	return __workpool_global.workers ? &__workpool_global : NULL;
+}
+
+/// @brief Call func on pieces of a memory range in parallel on the global pool.
+/// @param ptr Start of the range.
+/// @param size Size of the range.
+/// @param grain Piece size, 0 to pick one. Rounded to PAGE_SIZE or PMD_SIZE.
+/// @param func Called as func(piece, piece_size, arg).
+/// @param arg Passed to func.
+fn void parallel_for(void *ptr, size_t size, size_t grain, parallel_fn func, void *arg)
+{
+	workpool *pool = workpool_get();
+
+	if (!pool) {
+		func(ptr, size, arg);
+		return;
+	}
+
+	workpool_for(pool, ptr, size, grain, func, arg);
+}
+
+//
+// Index ranges
+//
+
+typedef void (*parallel_index_fn)(size_t begin, size_t end, void *arg);
+
+typedef struct __parallel_index_ctx {
+	parallel_index_fn func;
+	void *arg;
+} __parallel_index_ctx;
+
+// Indices ride on a fake address range, one PMD_SIZE per index, so that any
+// grain in indices is already aligned and pieces hold whole indices.
+fn void __parallel_index(void *ptr, size_t size, void *arg)
+{
+	__parallel_index_ctx *ctx = arg;
+	size_t begin = (unsigned long) ptr / PMD_SIZE;
+
+	ctx->func(begin, begin + size / PMD_SIZE, ctx->arg);
+}
+
+// Call func on pieces [begin, end) of [0, count) on all workers of the pool.
+// A grain of 0 picks one.
+fn void workpool_for_index(workpool *pool, size_t count, size_t grain, parallel_index_fn func, void *arg)
+{
+	__parallel_index_ctx ctx = { func, arg };
+
+	// Pick the grain in whole indices, a byte grain under PMD_SIZE would
+	// make pieces that hold no index at all
+	if (!grain)
+		grain = count / ((size_t) pool->nr * 8);
+	if (!grain)
+		grain = 1;
+
+	workpool_for(pool, NULL, count * PMD_SIZE, grain * PMD_SIZE, __parallel_index, &ctx);
+}
+
+/// @brief Call func on pieces of an index range in parallel on the global pool.
+/// @param count Indices in [0, count) are covered.
+/// @param grain Indices per piece, 0 to pick one.
+/// @param func Called as func(begin, end, arg).
+/// @param arg Passed to func.
+fn void parallel_for_index(size_t count, size_t grain, parallel_index_fn func, void *arg)
+{
+	workpool *pool = workpool_get();
+
+	if (!pool) {
+		func(0, count, arg);
+		return;
+	}
+
+	workpool_for_index(pool, count, grain, func, arg);
+}
+
+//
+// Parallel shuffle
+//
+
+// Bytes of each block shuffled in place in the first pass, sized for L2.
+#define MEMSHUFFLE_BLOCK KB(256)
+
+typedef struct __memshuffle_ctx {
+	void *list;
+	size_t len;
+	size_t width; // Elements per block, or per half of a merge
+	u64 seed;
+	u64 level;
+} __memshuffle_ctx;
+
+// Seed the independent stream of task id of a level, from a base seed.
+// Streams depend on the position in the merge tree only, never on scheduling.
+fn void __memshuffle_seed(prng_state *state, __memshuffle_ctx *ctx, size_t id)
+{
+	u64 x = ctx->seed + ((ctx->level << 48) ^ id) * 4;
+
+	for (int i = 0; i < 4; i++)
+		state->s[i] = __prng_splitmix(x + i);
+}
+
+// Declare a parallel memshuffle on given type with given name suffix.
+//
+// MergeShuffle (Bacher et al.): Fisher-Yates on cache-sized blocks in
+// parallel, then merge neighbours pairwise, level by level. A merge walks
+// both halves sequentially, picking the side of each element by a coin flip,
+// and inserts what is left when one side runs out by Fisher-Yates steps. Each
+// merge of two uniform halves is uniform, so is the result.
+#define memshuffle_parallel_decl(name, type) \
+fn void __memshuffle_block_##name(size_t begin, size_t end, void *arg) \
+{ \
+	__memshuffle_ctx *ctx = arg; \
+	prng_state state; \
+	type *list, tmp; \
+	size_t len, j; \
+	for (size_t b = begin; b < end; b++) { \
+		__memshuffle_seed(&state, ctx, b); \
+		list = (type *) ctx->list + b * ctx->width; \
+		len = ctx->len - b * ctx->width < ctx->width ? ctx->len - b * ctx->width : ctx->width; \
+		while (len) { \
+			j = prng_below(&state, len); \
+			len--; \
+			tmp = list[j]; \
+			list[j] = list[len]; \
+			list[len] = tmp; \
+		} \
+	} \
+} \
+\
+fn void __memshuffle_merge_##name(size_t begin, size_t end, void *arg) \
+{ \
+	__memshuffle_ctx *ctx = arg; \
+	prng_state state; \
+	type *list, tmp, x, y, ahead, mask; \
+	size_t len, i, j, k, take; \
+	u64 bits; \
+	int nbits; \
+	for (size_t p = begin; p < end; p++) { \
+		__memshuffle_seed(&state, ctx, p); \
+		list = (type *) ctx->list + p * 2 * ctx->width; \
+		len = ctx->len - p * 2 * ctx->width; \
+		if (len > 2 * ctx->width) \
+			len = 2 * ctx->width; \
+		if (len <= ctx->width) \
+			continue; \
+		i = 0; \
+		j = ctx->width; \
+		y = list[j]; \
+		bits = 0; \
+		nbits = 0; \
+		/* Branch-free on the coin since flips are unpredictable by design. The */ \
+		/* head of the second half stays in y, so no load waits on a store. */ \
+		while (j < len) { \
+			if (!nbits) { \
+				bits = prng_u64(&state); \
+				nbits = 64; \
+			} \
+			take = (bits >> --nbits) & 1; \
+			if (!take && i == j) \
+				goto fixup_##name; \
+			x = list[i]; \
+			ahead = list[j + 1 < len ? j + 1 : j]; \
+			mask = (type) -take; \
+			list[i] = x ^ ((x ^ y) & mask); \
+			list[j] = y ^ ((x ^ y) & mask); \
+			y ^= (y ^ ahead) & mask; \
+			j += take; \
+			i++; \
+		} \
+		/* Second half is used up, take from the first until the coin says otherwise */ \
+		for (;;) { \
+			if (!nbits) { \
+				bits = prng_u64(&state); \
+				nbits = 64; \
+			} \
+			if (((bits >> --nbits) & 1) || i == j) \
+				break; \
+			i++; \
+		} \
+fixup_##name: \
+		for (; i < len; i++) { \
+			k = prng_below(&state, i + 1); \
+			tmp = list[i]; \
+			list[i] = list[k]; \
+			list[k] = tmp; \
+		} \
+	} \
+} \
+\
+fn void __memshuffle_parallel_##name(prng_state *state, type *list, size_t len, size_t block) \
+{ \
+	__memshuffle_ctx ctx = { list, len, block, prng_u64(state), 0 }; \
+	parallel_for_index(__KERNEL_DIV_ROUND_UP(len, block), 1, __memshuffle_block_##name, &ctx); \
+	while (ctx.width < len) { \
+		ctx.level++; \
+		parallel_for_index(__KERNEL_DIV_ROUND_UP(len, 2 * ctx.width), 1, __memshuffle_merge_##name, &ctx); \
+		ctx.width *= 2; \
+	} \
+} \
+\
+fn void memshuffle_parallel_##name(prng_state *state, type *list, size_t len) \
+{ \
+	__memshuffle_parallel_##name(state, list, len, MEMSHUFFLE_BLOCK / sizeof(type)); \
+}
+
+memshuffle_parallel_decl(u64, u64)
+memshuffle_parallel_decl(u32, u32)
+memshuffle_parallel_decl(u16, u16)
+memshuffle_parallel_decl(u8, u8)
+
+// Shuffle an array with all workers of the global pool.
+// The caller may optionally provide a RNG state, or NULL to use global state.
+// Output is reproducible for a given state, whatever the number of workers.
+// Element sizes other than 8, 4, 2 and 1 fall back to the serial memshuffle().
+fn void memshuffle_parallel(prng_state *state, void *ptr, size_t elemsz, size_t elemcnt)
+{
+	switch (elemsz) {
+	case 8: return memshuffle_parallel_u64(state, ptr, elemcnt);
+	case 4: return memshuffle_parallel_u32(state, ptr, elemcnt);
+	case 2: return memshuffle_parallel_u16(state, ptr, elemcnt);
+	case 1: return memshuffle_parallel_u8(state, ptr, elemcnt);
+	default: break;
+	}
+
+	memshuffle(ptr, elemsz, elemcnt);
+}
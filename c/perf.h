@@ -0,0 +1,244 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "defer.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Hardware counter groups
+//
+
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_DTLB_MISSES 3
+#define PERF_PAGE_FAULTS 4
+#define PERF_COUNTERS 5
+
+#define __PERF_CACHE(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+typedef struct perf_counters {
+	u64 value[PERF_COUNTERS];
+	u32 valid; // BIT(PERF_*) of counters that could be opened
+} perf_counters;
+
+let perf_counters default_perf_counters = { 0 };
+
+typedef struct perf_group {
+	const char *name;
+	int leader;
+	int fd[PERF_COUNTERS];
+	int slot[PERF_COUNTERS]; // Index of each counter in the group read, or -1
+	int nr;
+} perf_group;
+
+fn const char *perf_counter_name(int counter)
+{
+	switch (counter) {
+	case PERF_CYCLES: return "cycles";
+	case PERF_INSTRUCTIONS: return "instructions";
+	case PERF_LLC_MISSES: return "LLC-misses";
+	case PERF_DTLB_MISSES: return "dTLB-misses";
+	case PERF_PAGE_FAULTS: return "page-faults";
+	default: return "unknown";
+	}
+}
+
+fn void __perf_attr(struct perf_event_attr *attr, int counter)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr->exclude_hv = 1;
+
+	switch (counter) {
+	case PERF_CYCLES:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PERF_INSTRUCTIONS:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PERF_LLC_MISSES:
+		attr->type = PERF_TYPE_HW_CACHE;
+		attr->config = __PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS);
+		break;
+	case PERF_DTLB_MISSES:
+		attr->type = PERF_TYPE_HW_CACHE;
+		attr->config = __PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS);
+		break;
+	case PERF_PAGE_FAULTS:
+		attr->type = PERF_TYPE_SOFTWARE;
+		attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+		break;
+	}
+}
+
+fn int __perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+	int fd = syscall(SYS_perf_event_open, attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+
+	// Unprivileged users may only count user space
+	if (fd < 0 && (errno == EACCES || errno == EPERM) && !attr->exclude_kernel) {
+		attr->exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	return fd;
+}
+
+fn void perf_group_close(perf_group *group)
+{
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (group->fd[i] >= 0)
+			close(group->fd[i]);
+		group->fd[i] = -1;
+		group->slot[i] = -1;
+	}
+
+	group->leader = -1;
+	group->nr = 0;
+}
+
+// Open all counters for the calling thread as a single group, so a single
+// read() returns all of them. Counters the machine lacks are skipped.
+// Return the number of counters opened.
+fn int perf_group_open(perf_group *group, const char *name)
+{
+	struct perf_event_attr attr;
+
+	group->name = name;
+	group->leader = -1;
+	group->nr = 0;
+
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		group->fd[i] = -1;
+		group->slot[i] = -1;
+	}
+
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		__perf_attr(&attr, i);
+		attr.disabled = group->leader < 0;
+
+		group->fd[i] = __perf_event_open(&attr, group->leader);
+		if (group->fd[i] < 0)
+			continue;
+
+		if (group->leader < 0)
+			group->leader = group->fd[i];
+
+		group->slot[i] = group->nr++;
+	}
+
+	if (!group->nr)
+		pr("Unable to open any perf counter for %s: errno %d", name, errno);
+
+	return group->nr;
+}
+
+fn void perf_group_start(perf_group *group)
+{
+	if (group->leader < 0)
+		return;
+
+	ioctl(group->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(group->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+fn void perf_group_stop(perf_group *group)
+{
+	if (group->leader < 0)
+		return;
+
+	ioctl(group->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// Read all counters of the group with a single read().
+// Values are scaled up when the kernel multiplexed the group.
+fn bool perf_group_read(perf_group *group, perf_counters *counters)
+{
+	u64 buf[3 + PERF_COUNTERS]; // nr, time_enabled, time_running, values
+	ssize_t ret;
+
+	*counters = default_perf_counters;
+
+	if (group->leader < 0)
+		return false;
+
+	ret = read(group->leader, buf, sizeof(buf));
+	if (ret < (ssize_t) (3 * sizeof(u64)) || buf[0] != group->nr)
+		return false;
+
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		u64 value;
+
+		if (group->slot[i] < 0)
+			continue;
+
+		value = buf[3 + group->slot[i]];
+		if (buf[2] && buf[2] < buf[1])
+			value = (u64) ((double) value * buf[1] / buf[2]);
+
+		counters->value[i] = value;
+		counters->valid |= BIT(i);
+	}
+
+	return true;
+}
+
+fn void perf_counters_add(perf_counters *acc, perf_counters *counters)
+{
+	for (int i = 0; i < PERF_COUNTERS; i++)
+		acc->value[i] += counters->value[i];
+
+	acc->valid |= counters->valid;
+}
+
+fn void perf_counters_report(const char *name, perf_counters *counters)
+{
+	pr_info("%s:\n", name);
+
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (counters->valid & BIT(i))
+			pr_info("\t%16llu  %s\n", counters->value[i], perf_counter_name(i));
+		else
+			pr_info("\t%16s  %s\n", "<not supported>", perf_counter_name(i));
+	}
+
+	if ((counters->valid & BIT(PERF_CYCLES)) && (counters->valid & BIT(PERF_INSTRUCTIONS)) && counters->value[PERF_CYCLES])
+		pr_info("\t%16.2f  IPC\n", counters->value[PERF_INSTRUCTIONS] * 1.0 / counters->value[PERF_CYCLES]);
+}
+
+fn void __perf_scope_end(perf_group *group, perf_counters *acc)
+{
+	perf_counters counters;
+
+	perf_group_stop(group);
+
+	if (perf_group_read(group, &counters)) {
+		if (acc)
+			perf_counters_add(acc, &counters);
+		else
+			perf_counters_report(group->name, &counters);
+	}
+
+	perf_group_close(group);
+}
+
+// The accumulator is captured first, since the defer body has its own "a" parameter.
+#define __PERF_SCOPE(name, acc, n) \
+	perf_counters *_DEFER_MERGE(____perf_scopeacc_, n) = (acc); \
+	perf_group _DEFER_MERGE(____perf_scopegroup_, n); \
+	perf_group_open(&_DEFER_MERGE(____perf_scopegroup_, n), name); \
+	perf_group_start(&_DEFER_MERGE(____perf_scopegroup_, n)); \
+	defer { __perf_scope_end(&_DEFER_MERGE(____perf_scopegroup_, n), _DEFER_MERGE(____perf_scopeacc_, n)); }
+
+/// @brief Count hardware events from here to the end of the scope.
+/// @param name Name used in the report.
+/// @param acc perf_counters to accumulate into, or NULL to report at scope exit.
+#define perf_scope(name, acc) __PERF_SCOPE(name, acc, __COUNTER__)
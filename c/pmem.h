@@ -0,0 +1,316 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "memory.h"
+#include "timing.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Cache line flush
+//
+
+#define PMEM_LINE 64
+
+#define PMEM_FLUSH_CLFLUSH 0
+#define PMEM_FLUSH_CLFLUSHOPT 1
+#define PMEM_FLUSH_CLWB 2
+#define PMEM_FLUSH_NT 3 // Non-temporal stores, nothing left to flush
+#define PMEM_FLUSH_MSYNC 4 // Page cache backed maps without MAP_SYNC
+#define PMEM_FLUSH_STRATEGIES 5
+
+fn const char *pmem_flush_name(int strategy)
+{
+	switch (strategy) {
+	case PMEM_FLUSH_CLFLUSH: return "clflush";
+	case PMEM_FLUSH_CLFLUSHOPT: return "clflushopt";
+	case PMEM_FLUSH_CLWB: return "clwb";
+	case PMEM_FLUSH_NT: return "movnt";
+	case PMEM_FLUSH_MSYNC: return "msync";
+	default: return "unknown";
+	}
+}
+
+// Get BIT(PMEM_FLUSH_*) of the cache line flush instructions of this CPU.
+fn u32 pmem_flush_supported(void)
+{
+	u32 supported = BIT(PMEM_FLUSH_NT) | BIT(PMEM_FLUSH_MSYNC);
+
+	if (cpu_has(CPU_CLFLUSH))
+		supported |= BIT(PMEM_FLUSH_CLFLUSH);
+
+	if (cpu_has(CPU_CLFLUSHOPT))
+		supported |= BIT(PMEM_FLUSH_CLFLUSHOPT);
+
+	if (cpu_has(CPU_CLWB))
+		supported |= BIT(PMEM_FLUSH_CLWB);
+
+	return supported;
+}
+
+// clflush is serialized with other flushes, so it needs no drain.
+fn void __pmem_flush_clflush(const void *ptr, size_t size)
+{
+	unsigned long line = ALIGN_DOWN((unsigned long) ptr, PMEM_LINE);
+
+	for (; line < (unsigned long) ptr + size; line += PMEM_LINE)
+		_mm_clflush((const void *) line);
+}
+
+__attribute__((target("clflushopt")))
+fn void __pmem_flush_clflushopt(const void *ptr, size_t size)
+{
+	unsigned long line = ALIGN_DOWN((unsigned long) ptr, PMEM_LINE);
+
+	for (; line < (unsigned long) ptr + size; line += PMEM_LINE)
+		_mm_clflushopt((void *) line);
+}
+
+// clwb writes the line back and may keep it cached for later reads.
+__attribute__((target("clwb")))
+fn void __pmem_flush_clwb(const void *ptr, size_t size)
+{
+	unsigned long line = ALIGN_DOWN((unsigned long) ptr, PMEM_LINE);
+
+	for (; line < (unsigned long) ptr + size; line += PMEM_LINE)
+		_mm_clwb((void *) line);
+}
+
+// Pick the cheapest flush this CPU has: clwb, then clflushopt, then clflush.
+fn int pmem_flush_best(void)
+{
+	u32 supported = pmem_flush_supported();
+
+	if (supported & BIT(PMEM_FLUSH_CLWB))
+		return PMEM_FLUSH_CLWB;
+
+	if (supported & BIT(PMEM_FLUSH_CLFLUSHOPT))
+		return PMEM_FLUSH_CLFLUSHOPT;
+
+	return PMEM_FLUSH_CLFLUSH;
+}
+
+fn void (*__resolve_pmem_flush(void))(const void *, size_t)
+{
+	switch (pmem_flush_best()) {
+	case PMEM_FLUSH_CLWB: return __pmem_flush_clwb;
+	case PMEM_FLUSH_CLFLUSHOPT: return __pmem_flush_clflushopt;
+	default: return __pmem_flush_clflush;
+	}
+}
+
+/// @brief Write back all cache lines covering a range, without waiting.
+fn void pmem_flush(const void *ptr, size_t size) __attribute__((ifunc("__resolve_pmem_flush")));
+
+/// @brief Wait for flushes and non-temporal stores to reach the persistence domain.
+fn void pmem_drain(void)
+{
+	_mm_sfence();
+}
+
+/// @brief Flush a range and wait for it.
+fn void pmem_persist(const void *ptr, size_t size)
+{
+	pmem_flush(ptr, size);
+	pmem_drain();
+}
+
+//
+// Non-temporal copy
+//
+
+__attribute__((target("avx512f")))
+fn void __pmem_stream_avx512(void *dst, const void *src, size_t size)
+{
+	for (; size >= 64; size -= 64, dst += 64, src += 64)
+		_mm512_stream_si512(dst, _mm512_loadu_si512(src));
+}
+
+__attribute__((target("avx2")))
+fn void __pmem_stream_avx2(void *dst, const void *src, size_t size)
+{
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		_mm256_stream_si256(dst, _mm256_loadu_si256(src));
+		_mm256_stream_si256(dst + 32, _mm256_loadu_si256(src + 32));
+	}
+}
+
+fn void __pmem_stream_sse2(void *dst, const void *src, size_t size)
+{
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		_mm_stream_si128(dst, _mm_loadu_si128(src));
+		_mm_stream_si128(dst + 16, _mm_loadu_si128(src + 16));
+		_mm_stream_si128(dst + 32, _mm_loadu_si128(src + 32));
+		_mm_stream_si128(dst + 48, _mm_loadu_si128(src + 48));
+	}
+}
+
+fn void (*__resolve_pmem_stream(void))(void *, const void *, size_t)
+{
+	switch (__cpu_vector_level()) {
+	case __CPU_VECTOR_AVX512: return __pmem_stream_avx512;
+	case __CPU_VECTOR_AVX2: return __pmem_stream_avx2;
+	default: return __pmem_stream_sse2;
+	}
+}
+
+// Size must be a multiple of 64 and dst aligned to 64.
+fn void __pmem_stream(void *dst, const void *src, size_t size) __attribute__((ifunc("__resolve_pmem_stream")));
+
+/// @brief Copy with non-temporal stores, then drain.
+/// The partial lines at either end are copied through the cache and flushed.
+fn void pmem_memcpy_nt(void *dst, const void *src, size_t size)
+{
+	size_t head = ALIGN((unsigned long) dst, PMEM_LINE) - (unsigned long) dst;
+	size_t body;
+
+	if (head > size)
+		head = size;
+
+	body = ALIGN_DOWN(size - head, PMEM_LINE);
+
+	if (head) {
+		memcpy(dst, src, head);
+		pmem_flush(dst, head);
+	}
+
+	__pmem_stream(dst + head, src + head, body);
+
+	if (size - head - body) {
+		memcpy(dst + head + body, src + head + body, size - head - body);
+		pmem_flush(dst + head + body, size - head - body);
+	}
+
+	pmem_drain();
+}
+
+//
+// Durable device writes
+//
+
+// Make a range of a device map durable, by cache line flush on MAP_SYNC maps,
+// by msync() otherwise.
+fn int __pmem_msync(void *ptr, size_t size)
+{
+	unsigned long start = ALIGN_DOWN((unsigned long) ptr, PAGE_SIZE);
+
+	if (msync((void *) start, (unsigned long) ptr + size - start, MS_SYNC)) {
+		pr("Unable to msync %s at %p: errno %d", format_size(size), ptr, errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+fn int pmem_device_persist(mmap_device_handle *handle, void *ptr, size_t size)
+{
+	if (!handle->sync)
+		return __pmem_msync(ptr, size);
+
+	pmem_persist(ptr, size);
+	return 0;
+}
+
+/// @brief Copy into a device map at offset, durable when it returns.
+/// @return 0, or -1 if the range is outside the map or cannot be synced.
+fn int pmem_device_memcpy(mmap_device_handle *handle, size_t offset, const void *src, size_t size)
+{
+	void *dst = handle->map + offset;
+
+	if (offset > handle->size || size > handle->size - offset) {
+		pr("Range %zu+%zu is outside the device map of %s", offset, size, format_size(handle->size));
+		return -1;
+	}
+
+	if (!handle->sync) {
+		memcpy(dst, src, size);
+		return pmem_device_persist(handle, dst, size);
+	}
+
+	pmem_memcpy_nt(dst, src, size);
+	return 0;
+}
+
+//
+// Flush strategy benchmark
+//
+
+// Write records of given size across a device map, persisting each one with
+// the given strategy. Return the time taken in ns, or 0 if not supported.
+fn u64 pmem_bench_strategy(mmap_device_handle *handle, int strategy, size_t record, size_t size, const u8 *src)
+{
+	u8 *map = handle->map;
+	u64 begin, end;
+
+	if (!(pmem_flush_supported() & BIT(strategy)))
+		return 0;
+
+	begin = get_current_ns();
+
+	for (size_t off = 0; off + record <= size; off += record) {
+		switch (strategy) {
+		case PMEM_FLUSH_CLFLUSH:
+			memcpy(map + off, src, record);
+			__pmem_flush_clflush(map + off, record);
+			break;
+		case PMEM_FLUSH_CLFLUSHOPT:
+			memcpy(map + off, src, record);
+			__pmem_flush_clflushopt(map + off, record);
+			pmem_drain();
+			break;
+		case PMEM_FLUSH_CLWB:
+			memcpy(map + off, src, record);
+			__pmem_flush_clwb(map + off, record);
+			pmem_drain();
+			break;
+		case PMEM_FLUSH_NT:
+			pmem_memcpy_nt(map + off, src, record);
+			break;
+		case PMEM_FLUSH_MSYNC:
+			memcpy(map + off, src, record);
+			__pmem_msync(map + off, record);
+			break;
+		}
+	}
+
+	end = get_current_ns();
+	return end - begin;
+}
+
+/// @brief Compare flush strategies on a device map with records of given size.
+/// At most MB(64) of the map is written, msync() covers a tenth of that.
+fn void pmem_bench(mmap_device_handle *handle, size_t record)
+{
+	size_t size = handle->size < MB(64) ? handle->size : MB(64);
+	u8 *src = malloc(record);
+
+	if (!src || !record || record > size) {
+		pr("Unable to benchmark records of %s over %s", format_size(record), format_size(size));
+		free(src);
+		return;
+	}
+
+	prng_bytes(NULL, src, record);
+	memfault(handle->map, size);
+
+	pr_info("Persist %s records over %s (%s):\n", format_size(record), format_size(size), handle->sync ? "MAP_SYNC" : "page cache");
+
+	for (int strategy = 0; strategy < PMEM_FLUSH_STRATEGIES; strategy++) {
+		// msync is orders of magnitude slower per record
+		size_t span = strategy == PMEM_FLUSH_MSYNC ? size / 10 : size;
+		size_t count = span / record;
+		u64 ns = count ? pmem_bench_strategy(handle, strategy, record, span, src) : 0;
+
+		if (!ns) {
+			pr_info("\t%12s  %16s\n", pmem_flush_name(strategy), "<not supported>");
+			continue;
+		}
+
+		pr_info("\t%12s  %10.1f ns/record  %8.2f GB/s\n", pmem_flush_name(strategy), (double) ns / count, (double) count * record / ns);
+	}
+
+	free(src);
+}
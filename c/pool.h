@@ -0,0 +1,209 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Fixed-size object pool
+//
+
+// Objects cached by each thread before touching the global stack.
+#define POOL_MAGAZINE 64
+#define POOL_NIL 0xffffffffU
+
+// Objects are addressed by a u32 index into one mapping, so the global free
+// stack head packs {u32 tag, u32 index} into a single u64. The tag is bumped
+// on every update, which makes the CAS immune to ABA.
+typedef struct pool {
+	mmap_alloc_handle *handle;
+	u8 *base;
+	size_t objsz;
+	u32 capacity;
+	u32 fresh __attribute__((aligned(64))); // Next never-used index
+	u64 head __attribute__((aligned(64))); // Tagged top of the free stack
+} pool;
+
+typedef struct pool_magazine {
+	u32 count;
+	u32 idx[POOL_MAGAZINE];
+} pool_magazine;
+
+#define __POOL_TAGGED(tag, idx) (((u64) (tag) << 32) | (u32) (idx))
+#define __POOL_TAG(head) ((u32) ((head) >> 32))
+#define __POOL_IDX(head) ((u32) (head))
+
+// Free objects store the index of the next free object in their first bytes.
+fn u32 *__pool_next(pool *pool, u32 idx)
+{
+	return (u32 *) (pool->base + (size_t) idx * pool->objsz);
+}
+
+// Initialize a pool of capacity objects of objsz bytes each.
+// The backing memory is reserved up front and faulted in on first use.
+fn int pool_init(pool *pool, size_t objsz, size_t align, u32 capacity, bool huge)
+{
+	size_t size;
+
+	if (objsz < sizeof(u32))
+		objsz = sizeof(u32);
+
+	pool->objsz = ALIGN(objsz, align ? align : 1);
+	pool->capacity = capacity < POOL_NIL ? capacity : POOL_NIL - 1;
+	pool->fresh = 0;
+	pool->head = __POOL_TAGGED(0, POOL_NIL);
+
+	size = pool->objsz * pool->capacity;
+	pool->handle = huge ? mmap_alloc_huge(size, PMD_SIZE) : mmap_alloc(size);
+	if (!pool->handle) {
+		pr("Unable to map pool of %s", format_size(size));
+		pool->base = NULL;
+		return -1;
+	}
+
+	pool->base = pool->handle->map;
+	return 0;
+}
+
+fn void pool_destroy(pool *pool)
+{
+	mmap_free(pool->handle);
+	pool->handle = NULL;
+	pool->base = NULL;
+}
+
+// Push a chain of objects linked through their next index onto the free stack.
+fn void __pool_push_chain(pool *pool, u32 first, u32 last)
+{
+	u64 old = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+	u64 new;
+
+	do {
+		*__pool_next(pool, last) = __POOL_IDX(old);
+		new = __POOL_TAGGED(__POOL_TAG(old) + 1, first);
+	} while (!__atomic_compare_exchange_n(&pool->head, &old, new, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Pop an object off the free stack, or POOL_NIL if empty.
+fn u32 __pool_pop(pool *pool)
+{
+	u64 old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	u64 new;
+	u32 idx;
+
+	do {
+		idx = __POOL_IDX(old);
+		if (idx == POOL_NIL)
+			return POOL_NIL;
+
+		// The object may be taken and reused meanwhile, the tag then fails the CAS
+		new = __POOL_TAGGED(__POOL_TAG(old) + 1, __atomic_load_n(__pool_next(pool, idx), __ATOMIC_RELAXED));
+	} while (!__atomic_compare_exchange_n(&pool->head, &old, new, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return idx;
+}
+
+// Refill half a magazine from the free stack, then from never-used objects.
+fn void __pool_refill(pool *pool, pool_magazine *mag)
+{
+	u32 want = POOL_MAGAZINE / 2;
+	u32 idx;
+
+	while (mag->count < want) {
+		idx = __pool_pop(pool);
+		if (idx == POOL_NIL)
+			break;
+		mag->idx[mag->count++] = idx;
+	}
+
+	if (mag->count < want) {
+		u32 first = __atomic_load_n(&pool->fresh, __ATOMIC_RELAXED);
+		u32 take;
+
+		// Claim with a CAS, so fresh never runs past capacity and wraps
+		do {
+			if (first >= pool->capacity)
+				return;
+
+			take = want - mag->count;
+			if (take > pool->capacity - first)
+				take = pool->capacity - first;
+		} while (!__atomic_compare_exchange_n(&pool->fresh, &first, first + take, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		for (u32 i = 0; i < take; i++)
+			mag->idx[mag->count++] = first + i;
+	}
+}
+
+// Allocate an object, return NULL when the pool is exhausted.
+fn void *pool_alloc(pool *pool, pool_magazine *mag)
+{
+	if (unlikely(!mag->count)) {
+		__pool_refill(pool, mag);
+		if (!mag->count)
+			return NULL;
+	}
+
+	return pool->base + (size_t) mag->idx[--mag->count] * pool->objsz;
+}
+
+// Return count objects from the top of the magazine to the free stack at once.
+fn void __pool_drain(pool *pool, pool_magazine *mag, u32 count)
+{
+	u32 first, last;
+
+	if (!count)
+		return;
+
+	mag->count -= count;
+	first = mag->idx[mag->count];
+	last = mag->idx[mag->count + count - 1];
+
+	for (u32 i = mag->count; i < mag->count + count - 1; i++)
+		*__pool_next(pool, mag->idx[i]) = mag->idx[i + 1];
+
+	__pool_push_chain(pool, first, last);
+}
+
+fn void pool_free(pool *pool, pool_magazine *mag, void *obj)
+{
+	if (unlikely(mag->count == POOL_MAGAZINE))
+		__pool_drain(pool, mag, POOL_MAGAZINE / 2);
+
+	mag->idx[mag->count++] = ((u8 *) obj - pool->base) / pool->objsz;
+}
+
+// Return all objects cached by a magazine, call it before the thread exits.
+fn void pool_flush(pool *pool, pool_magazine *mag)
+{
+	__pool_drain(pool, mag, mag->count);
+}
+
+// Declare a global pool of given type with given name suffix.
+// Each thread gets its own magazine, only the global stack is shared.
+#define pool_decl(name, type) \
+mut pool pool_##name; \
+mut __thread pool_magazine __pool_##name##_magazine; \
+fn int pool_##name##_init(u32 capacity, bool huge) \
+{ \
+	return pool_init(&pool_##name, sizeof(type), __alignof__(type), capacity, huge); \
+} \
+fn void pool_##name##_destroy(void) \
+{ \
+	pool_destroy(&pool_##name); \
+} \
+fn type *pool_##name##_alloc(void) \
+{ \
+	return pool_alloc(&pool_##name, &__pool_##name##_magazine); \
+} \
+fn void pool_##name##_free(type *obj) \
+{ \
+	pool_free(&pool_##name, &__pool_##name##_magazine, obj); \
+} \
+fn void pool_##name##_flush(void) \
+{ \
+	pool_flush(&pool_##name, &__pool_##name##_magazine); \
+}
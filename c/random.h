@@ -3,87 +3,280 @@
 #include "headers.h"
 #include "common.h"
 #include "kernel.h"
+#include "cpu.h"
 
 //
 // TRNG
 //
 
-// Extract a secure random via RDSEED instruction.
-fn u64 trng_u64_rdseed(void)
-{
-	u64 val = 0;
+// Bytes of OS entropy fetched at once into the per-process pool.
+#define TRNG_POOL_SIZE KB(4)
 
-	__asm__ __volatile__(
-		"1:\n"
-		"rdseed %%rax\n"
-		"jnc 1b\n"
-		: "=a" (val)
-		: "a" (val)
-	);
+// Attempts of RDSEED per word before falling back to the pool, the pause
+// between attempts doubles up to TRNG_RDSEED_BACKOFF.
+#define TRNG_RDSEED_RETRIES 32
+#define TRNG_RDSEED_BACKOFF 1024
 
-	return val;
-}
+// Attempts of RDRAND per word, it only fails on a broken DRNG.
+#define TRNG_RDRAND_RETRIES 10
 
 #define __RNDGETENTCNT _IOR('R', 0x00, int)
 
-// Extract a secure random via /dev/random.
-fn u64 trng_u64_dev(void)
+typedef struct __trng_pool {
+	pthread_mutex_t lock;
+	size_t avail; // Unused bytes at the end of buf
+	int fd; // Cached /dev/random, or -1 when getrandom() works
+	u8 buf[TRNG_POOL_SIZE];
+} __trng_pool;
+
+mut __trng_pool __trng_pool_global = { PTHREAD_MUTEX_INITIALIZER, 0, -1 };
+mut pthread_once_t __trng_pool_once = PTHREAD_ONCE_INIT;
+
+// A forked child must never hand out the entropy its parent will use.
+fn void __trng_pool_atfork_child(void)
+{
+	pthread_mutex_init(&__trng_pool_global.lock, NULL);
+	__trng_pool_global.avail = 0;
+}
+
+fn void __trng_pool_init(void)
+{
+	pthread_atfork(NULL, NULL, __trng_pool_atfork_child);
+}
+
+// Open /dev/random once, checking that it is a random device.
+fn int __trng_dev_fd(__trng_pool *pool)
 {
-	u64 val = 0;
-	ssize_t ret = 0;
-	ssize_t got = 0;
 	int entropy = 0;
-	int fd = open("/dev/random", O_RDONLY);
+	int fd;
 
+	if (pool->fd >= 0)
+		return pool->fd;
+
+	fd = open("/dev/random", O_RDONLY | O_CLOEXEC);
 	if (unlikely(fd < 0))
-		return 0; // Unabe to open device
+		return -1; // Unable to open device
 
-	if (ioctl(fd, __RNDGETENTCNT, &entropy))
-		return 0; // /dev/random is not a random device
+	if (ioctl(fd, __RNDGETENTCNT, &entropy)) {
+		close(fd);
+		return -1; // /dev/random is not a random device
+	}
 
-	if (entropy < sizeof(val) * 8)
-		return 0; // Not enough entropy
+	pool->fd = fd;
+	return fd;
+}
 
-	while (got < sizeof(val))
-	{
-		ret = read(fd, ((u8*) &val) + got, sizeof(val) - got);
+// Fill the buffer with OS entropy, through getrandom() or else /dev/random.
+// Return false if neither is available.
+fn bool __trng_os_bytes(__trng_pool *pool, void *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t ret;
+	int fd;
+
+	while (got < len) {
+		ret = syscall(SYS_getrandom, (u8 *) buf + got, len - got, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		got += ret;
+	}
 
-		if (ret < 0) {
-			close(fd);
-			return 0; // Read from device failed
-		}
+	if (got == len)
+		return true;
 
+	fd = __trng_dev_fd(pool);
+	if (fd < 0)
+		return false;
+
+	while (got < len) {
+		ret = read(fd, (u8 *) buf + got, len - got);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false; // Read from device failed
 		got += ret;
 	}
 
-	close(fd);
+	return true;
+}
+
+// Fill the buffer from the per-process entropy pool, refilled in bulk.
+// Return false if no OS entropy source is available.
+fn bool trng_bytes(void *buf, size_t len)
+{
+	__trng_pool *pool = &__trng_pool_global;
+	u8 *out = buf;
+	size_t chunk;
+	bool ok = true;
+
+	pthread_once(&__trng_pool_once, __trng_pool_init);
+
+	// Large requests do not go through the pool
+	if (len >= TRNG_POOL_SIZE)
+		return __trng_os_bytes(pool, buf, len);
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (len) {
+		if (!pool->avail) {
+			ok = __trng_os_bytes(pool, pool->buf, TRNG_POOL_SIZE);
+			if (!ok)
+				break;
+			pool->avail = TRNG_POOL_SIZE;
+		}
+
+		chunk = len < pool->avail ? len : pool->avail;
+		pool->avail -= chunk;
+		memcpy(out, pool->buf + pool->avail, chunk);
+
+		// Entropy handed out is never kept around
+		memset(pool->buf + pool->avail, 0, chunk);
+
+		out += chunk;
+		len -= chunk;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return ok;
+}
+
+// Extract a secure random via the OS entropy pool, or 0 if unavailable.
+fn u64 trng_u64_dev(void)
+{
+	u64 val = 0;
+
+	if (!trng_bytes(&val, sizeof(val)))
+		return 0;
+
 	return val;
 }
 
-#define __CPUID_RDRND_MASK (1ULL << 30)
+// Fill words via RDSEED, pausing with growing backoff while the DRNG is
+// drained instead of spinning on it. Return the number of words filled.
+__attribute__((target("rdseed")))
+fn size_t trng_rdseed_fill(u64 *out, size_t n)
+{
+	unsigned long long val;
+	size_t i;
 
-fn u64 (*__resolve_trng_u64(void))(void)
+	for (i = 0; i < n; i++) {
+		int attempt = 0;
+		int pause = 1;
+
+		while (!_rdseed64_step(&val)) {
+			if (++attempt >= TRNG_RDSEED_RETRIES)
+				return i;
+
+			for (int p = 0; p < pause; p++)
+				_mm_pause();
+
+			if (pause < TRNG_RDSEED_BACKOFF)
+				pause *= 2;
+		}
+
+		out[i] = val;
+	}
+
+	return i;
+}
+
+// Extract a secure random via RDSEED instruction, the OS pool backs it up.
+fn u64 trng_u64_rdseed(void)
+{
+	u64 val;
+
+	if (trng_rdseed_fill(&val, 1))
+		return val;
+
+	return trng_u64_dev();
+}
+
+// Fill words via RDSEED, the OS pool backs up what it could not provide.
+fn bool trng_fill_rdseed(u64 *out, size_t n)
+{
+	size_t got = trng_rdseed_fill(out, n);
+
+	return got == n || trng_bytes(out + got, (n - got) * sizeof(u64));
+}
+
+fn bool trng_fill_dev(u64 *out, size_t n)
+{
+	return trng_bytes(out, n * sizeof(u64));
+}
+
+// Fill words via RDRAND. Its output comes from a DRBG reseeded by the same
+// source as RDSEED, which makes it good for seeding and much faster where
+// RDSEED is missing. Return the number of words filled.
+__attribute__((target("rdrnd")))
+fn size_t trng_rdrand_fill(u64 *out, size_t n)
+{
+	unsigned long long val;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		int attempt = 0;
+
+		while (!_rdrand64_step(&val)) {
+			if (++attempt >= TRNG_RDRAND_RETRIES)
+				return i;
+		}
+
+		out[i] = val;
+	}
+
+	return i;
+}
+
+// Extract a secure random via RDRAND instruction, the OS pool backs it up.
+fn u64 trng_u64_rdrand(void)
+{
+	u64 val;
+
+	if (trng_rdrand_fill(&val, 1))
+		return val;
+
+	return trng_u64_dev();
+}
+
+// Fill words via RDRAND, the OS pool backs up what it could not provide.
+fn bool trng_fill_rdrand(u64 *out, size_t n)
 {
-	unsigned int eax = 1;
-	unsigned int ebx = 0;
-	unsigned int ecx = 0;
-	unsigned int edx = 0;
+	size_t got = trng_rdrand_fill(out, n);
 
-	__asm__ __volatile__(
-		"cpuid"
-		: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
-		: "a"(eax)
-	);
+	return got == n || trng_bytes(out + got, (n - got) * sizeof(u64));
+}
 
-	if (ecx & __CPUID_RDRND_MASK)
+// Prefer RDSEED, then RDRAND, then the OS entropy pool.
+fn u64 (*__resolve_trng_u64(void))(void)
+{
+	if (cpu_has(CPU_RDSEED))
 		return trng_u64_rdseed;
 
+	if (cpu_has(CPU_RDRAND))
+		return trng_u64_rdrand;
+
 	return trng_u64_dev;
 }
 
+fn bool (*__resolve_trng_fill(void))(u64 *, size_t)
+{
+	if (cpu_has(CPU_RDSEED))
+		return trng_fill_rdseed;
+
+	if (cpu_has(CPU_RDRAND))
+		return trng_fill_rdrand;
+
+	return trng_fill_dev;
+}
+
 // Extract a secure random.
 fn u64 trng_u64(void) __attribute__((ifunc("__resolve_trng_u64")));
 
+// Fill words with secure randoms, return false if no source is available.
+fn bool trng_fill(u64 *out, size_t n) __attribute__((ifunc("__resolve_trng_fill")));
+
 //
 // PRNG
 //
@@ -110,10 +303,8 @@ fn bool prng_seed(prng_state *state)
 
 	do
 	{
-		state->s[0] = trng_u64();
-		state->s[1] = trng_u64();
-		state->s[2] = trng_u64();
-		state->s[3] = trng_u64();
+		if (!trng_fill(state->s, 4))
+			state->s[0] = state->s[1] = state->s[2] = state->s[3] = 0;
 
 		if (unlikely(++iter > 32)) {
 			u64 *heap = malloc(16);
@@ -193,13 +384,278 @@ fn u32 prng_u32(prng_state *state)
 	return (u32) (prng_u64(state) >> 32);
 }
 
-// Fill the buffer with random bytes.
+// Produces a value in the range [0, bound), bound must not be 0.
+// Lemire's multiply-shift, the division only runs on the rare rejection path.
 // The caller may optionally provide a RNG state, or NULL to use global state.
-fn void prng_bytes(prng_state *state, u8 *buf, size_t len)
+fn u64 prng_below(prng_state *state, u64 bound)
+{
+	__uint128_t m = (__uint128_t) prng_u64(state) * bound;
+	u64 low = (u64) m;
+
+	if (unlikely(low < bound)) {
+		u64 threshold = -bound % bound;
+
+		while (low < threshold) {
+			m = (__uint128_t) prng_u64(state) * bound;
+			low = (u64) m;
+		}
+	}
+
+	return (u64) (m >> 64);
+}
+
+// Advance the state by 2^k calls, k given by the polynomial in jump.
+fn void __prng_jump(prng_state *state, const u64 jump[4])
+{
+	u64 s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+	for (int i = 0; i < 4; i++) {
+		for (int b = 0; b < 64; b++) {
+			if (jump[i] & (1ULL << b)) {
+				s0 ^= state->s[0];
+				s1 ^= state->s[1];
+				s2 ^= state->s[2];
+				s3 ^= state->s[3];
+			}
+			prng_u64(state);
+		}
+	}
+
+	state->s[0] = s0;
+	state->s[1] = s1;
+	state->s[2] = s2;
+	state->s[3] = s3;
+}
+
+// Advance the state by 2^128 calls.
+// It can be used to generate 2^128 non-overlapping subsequences for parallel computations.
+// The caller may optionally provide a RNG state, or NULL to use global state.
+fn void prng_jump(prng_state *state)
+{
+	static const u64 jump[4] = {
+		0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+		0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL,
+	};
+
+	__prng_jump(state ? state : __prng_global(), jump);
+}
+
+// Advance the state by 2^192 calls.
+// It can be used to generate 2^64 starting points, from each of which prng_jump()
+// will generate 2^64 non-overlapping subsequences for parallel distributed computations.
+// The caller may optionally provide a RNG state, or NULL to use global state.
+fn void prng_long_jump(prng_state *state)
+{
+	static const u64 long_jump[4] = {
+		0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+		0x77710069854ee241ULL, 0x39109bb02acbe635ULL,
+	};
+
+	__prng_jump(state ? state : __prng_global(), long_jump);
+}
+
+//
+// Wide PRNG
+//
+
+// Bulk fills run PRNG_WIDE_LANES independent xoshiro256** streams interleaved
+// at u64 granularity, so the output only depends on the seed, never on the ISA
+// picked at runtime. Lane i produces bytes [8 * i, 8 * i + 8) of every block.
+
+#define PRNG_WIDE_LANES 8
+#define PRNG_WIDE_BLOCK (PRNG_WIDE_LANES * sizeof(u64))
+
+// Buffers shorter than this are not worth the lane setup cost.
+#define PRNG_WIDE_MIN KB(1)
+
+typedef struct prng_wide_state {
+	u64 s[4][PRNG_WIDE_LANES];
+} __attribute__((aligned(64))) prng_wide_state;
+
+// Mix a u64 with SplitMix64 finalizer, used to decorrelate lane seeds.
+fn u64 __prng_splitmix(u64 x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// Derive the lane states from a scalar state, advancing it.
+fn void __prng_wide_seed(prng_state *state, prng_wide_state *wide)
+{
+	for (int lane = 0; lane < PRNG_WIDE_LANES; lane++) {
+		do {
+			for (int word = 0; word < 4; word++)
+				wide->s[word][lane] = __prng_splitmix(prng_u64(state));
+		} while (unlikely(!(wide->s[0][lane] | wide->s[1][lane] | wide->s[2][lane] | wide->s[3][lane])));
+	}
+}
+
+// Derive the lane states by jumping, so lane i is the state advanced by i
+// calls of prng_jump(), then advance the state past all lanes. Every lane
+// then draws from its own non-overlapping subsequence of the state.
+fn void __prng_wide_seed_jump(prng_state *state, prng_wide_state *wide)
+{
+	for (int lane = 0; lane < PRNG_WIDE_LANES; lane++) {
+		for (int word = 0; word < 4; word++)
+			wide->s[word][lane] = state->s[word];
+
+		prng_jump(state);
+	}
+}
+
+// Fill blocks of PRNG_WIDE_BLOCK bytes, one lane after another within a block.
+fn void __prng_wide_fill_scalar(prng_wide_state *wide, u8 *buf, size_t blocks)
+{
+	u64 s0, s1, s2, s3, t;
+
+	for (size_t i = 0; i < blocks; i++) {
+		for (int lane = 0; lane < PRNG_WIDE_LANES; lane++) {
+			u64 result;
+
+			s0 = wide->s[0][lane];
+			s1 = wide->s[1][lane];
+			s2 = wide->s[2][lane];
+			s3 = wide->s[3][lane];
+
+			result = __prng_rotl(s1 * 5, 7) * 9;
+			memcpy(buf + lane * sizeof(u64), &result, sizeof(result));
+
+			t = s1 << 17;
+
+			s2 ^= s0;
+			s3 ^= s1;
+			s1 ^= s2;
+			s0 ^= s3;
+
+			s2 ^= t;
+			s3 = __prng_rotl(s3, 45);
+
+			wide->s[0][lane] = s0;
+			wide->s[1][lane] = s1;
+			wide->s[2][lane] = s2;
+			wide->s[3][lane] = s3;
+		}
+
+		buf += PRNG_WIDE_BLOCK;
+	}
+}
+
+#define __PRNG_AVX2_ROTL(x, k) \
+	_mm256_or_si256(_mm256_slli_epi64((x), (k)), _mm256_srli_epi64((x), 64 - (k)))
+
+// Fill blocks of PRNG_WIDE_BLOCK bytes, two YMM registers per state word.
+// AVX2 has no 64-bit multiply, so x * 5 and x * 9 are done as shift-and-add.
+__attribute__((target("avx2")))
+fn void __prng_wide_fill_avx2(prng_wide_state *wide, u8 *buf, size_t blocks)
+{
+	__m256i s0[2], s1[2], s2[2], s3[2], t, r;
+
+	for (int h = 0; h < 2; h++) {
+		s0[h] = _mm256_load_si256((__m256i *) &wide->s[0][4 * h]);
+		s1[h] = _mm256_load_si256((__m256i *) &wide->s[1][4 * h]);
+		s2[h] = _mm256_load_si256((__m256i *) &wide->s[2][4 * h]);
+		s3[h] = _mm256_load_si256((__m256i *) &wide->s[3][4 * h]);
+	}
+
+	for (size_t i = 0; i < blocks; i++) {
+		for (int h = 0; h < 2; h++) {
+			r = _mm256_add_epi64(_mm256_slli_epi64(s1[h], 2), s1[h]);
+			r = __PRNG_AVX2_ROTL(r, 7);
+			r = _mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+			_mm256_storeu_si256((__m256i *) (buf + 32 * h), r);
+
+			t = _mm256_slli_epi64(s1[h], 17);
+
+			s2[h] = _mm256_xor_si256(s2[h], s0[h]);
+			s3[h] = _mm256_xor_si256(s3[h], s1[h]);
+			s1[h] = _mm256_xor_si256(s1[h], s2[h]);
+			s0[h] = _mm256_xor_si256(s0[h], s3[h]);
+
+			s2[h] = _mm256_xor_si256(s2[h], t);
+			s3[h] = __PRNG_AVX2_ROTL(s3[h], 45);
+		}
+
+		buf += PRNG_WIDE_BLOCK;
+	}
+
+	for (int h = 0; h < 2; h++) {
+		_mm256_store_si256((__m256i *) &wide->s[0][4 * h], s0[h]);
+		_mm256_store_si256((__m256i *) &wide->s[1][4 * h], s1[h]);
+		_mm256_store_si256((__m256i *) &wide->s[2][4 * h], s2[h]);
+		_mm256_store_si256((__m256i *) &wide->s[3][4 * h], s3[h]);
+	}
+}
+
+// Fill blocks of PRNG_WIDE_BLOCK bytes, one ZMM register per state word.
+// Only AVX-512F is required, vpmullq (AVX-512DQ) is avoided the same way as AVX2.
+__attribute__((target("avx512f")))
+fn void __prng_wide_fill_avx512(prng_wide_state *wide, u8 *buf, size_t blocks)
+{
+	__m512i s0, s1, s2, s3, t, r;
+
+	s0 = _mm512_load_si512(wide->s[0]);
+	s1 = _mm512_load_si512(wide->s[1]);
+	s2 = _mm512_load_si512(wide->s[2]);
+	s3 = _mm512_load_si512(wide->s[3]);
+
+	for (size_t i = 0; i < blocks; i++) {
+		r = _mm512_add_epi64(_mm512_slli_epi64(s1, 2), s1);
+		r = _mm512_rol_epi64(r, 7);
+		r = _mm512_add_epi64(_mm512_slli_epi64(r, 3), r);
+		_mm512_storeu_si512(buf, r);
+
+		t = _mm512_slli_epi64(s1, 17);
+
+		s2 = _mm512_xor_si512(s2, s0);
+		s3 = _mm512_xor_si512(s3, s1);
+		s1 = _mm512_xor_si512(s1, s2);
+		s0 = _mm512_xor_si512(s0, s3);
+
+		s2 = _mm512_xor_si512(s2, t);
+		s3 = _mm512_rol_epi64(s3, 45);
+
+		buf += PRNG_WIDE_BLOCK;
+	}
+
+	_mm512_store_si512(wide->s[0], s0);
+	_mm512_store_si512(wide->s[1], s1);
+	_mm512_store_si512(wide->s[2], s2);
+	_mm512_store_si512(wide->s[3], s3);
+}
+
+fn void (*__resolve_prng_wide_fill(void))(prng_wide_state *, u8 *, size_t)
+{
+	switch (__cpu_vector_level()) {
+	case __CPU_VECTOR_AVX512: return __prng_wide_fill_avx512;
+	case __CPU_VECTOR_AVX2: return __prng_wide_fill_avx2;
+	default: return __prng_wide_fill_scalar;
+	}
+}
+
+// Fill blocks of PRNG_WIDE_BLOCK bytes with the widest engine available.
+fn void __prng_wide_fill(prng_wide_state *wide, u8 *buf, size_t blocks) __attribute__((ifunc("__resolve_prng_wide_fill")));
+
+fn void __prng_bytes(prng_state *state, u8 *buf, size_t len, bool jump)
 {
 	u64 s0, s1, s2, s3, t;
 	prng_state *current = state ? state : __prng_global();
 
+	if (len >= PRNG_WIDE_MIN) {
+		prng_wide_state wide;
+		size_t blocks = len / PRNG_WIDE_BLOCK;
+
+		if (jump)
+			__prng_wide_seed_jump(current, &wide);
+		else
+			__prng_wide_seed(current, &wide);
+		__prng_wide_fill(&wide, buf, blocks);
+
+		buf += blocks * PRNG_WIDE_BLOCK;
+		len -= blocks * PRNG_WIDE_BLOCK;
+	}
+
 	s0 = current->s[0];
 	s1 = current->s[1];
 	s2 = current->s[2];
@@ -247,6 +703,287 @@ fn void prng_bytes(prng_state *state, u8 *buf, size_t len)
 	current->s[3] = s3;
 }
 
+// Fill the buffer with random bytes.
+// The caller may optionally provide a RNG state, or NULL to use global state.
+// Large buffers are filled by the wide engine seeded from the given state.
+fn void prng_bytes(prng_state *state, u8 *buf, size_t len)
+{
+	__prng_bytes(state, buf, len, false);
+}
+
+// Same as prng_bytes(), but the lanes of the wide engine are derived by
+// prng_jump() instead of seeded from outputs, so every byte comes from a
+// subsequence of the state that no other lane or later call overlaps. The
+// state ends up PRNG_WIDE_LANES jumps ahead. The jumps cost a few
+// microseconds, worth it on large buffers only.
+fn void prng_bytes_jump(prng_state *state, u8 *buf, size_t len)
+{
+	__prng_bytes(state, buf, len, true);
+}
+
+//
+// Distributions
+//
+
+// Produces a value in the range [0, bound), bound must not be 0.
+// Same as prng_below() with a 64-bit multiply only.
+fn u32 prng_below32(prng_state *state, u32 bound)
+{
+	u64 m = (u64) prng_u32(state) * bound;
+	u32 low = (u32) m;
+
+	if (unlikely(low < bound)) {
+		u32 threshold = -bound % bound;
+
+		while (low < threshold) {
+			m = (u64) prng_u32(state) * bound;
+			low = (u32) m;
+		}
+	}
+
+	return (u32) (m >> 32);
+}
+
+// Produces a value in the range [0, 1) from the top 53 bits.
+fn double prng_double(prng_state *state)
+{
+	return (prng_u64(state) >> 11) * 0x1.0p-53;
+}
+
+// Produces a value in the range [0, 1) from the top 24 bits.
+fn float prng_float(prng_state *state)
+{
+	return (prng_u32(state) >> 8) * 0x1.0p-24f;
+}
+
+// Produces a value from the exponential distribution of given rate.
+fn double prng_exponential(prng_state *state, double lambda)
+{
+	return -log1p(-prng_double(state)) / lambda;
+}
+
+// Convert a geometric draw to an integer, saturating where it would overflow.
+fn u64 __prng_geometric_u64(double x)
+{
+	return x < 0x1.0p64 ? (u64) x : UINT64_MAX;
+}
+
+// Produces the number of failures before the first success of probability p.
+// p must be in (0, 1], UINT64_MAX is returned for any other p (or NaN), as
+// the success never comes.
+fn u64 prng_geometric(prng_state *state, double p)
+{
+	if (!(p > 0 && p <= 1))
+		return UINT64_MAX;
+
+	if (p == 1)
+		return 0;
+
+	return __prng_geometric_u64(floor(log1p(-prng_double(state)) / log1p(-p)));
+}
+
+// Produces a pair of standard normal values by the Marsaglia polar method.
+fn void __prng_normal_pair(prng_state *state, double *x, double *y)
+{
+	double u, v, r;
+
+	do {
+		u = 2 * prng_double(state) - 1;
+		v = 2 * prng_double(state) - 1;
+		r = u * u + v * v;
+	} while (r >= 1 || r == 0);
+
+	r = sqrt(-2 * log(r) / r);
+	*x = u * r;
+	*y = v * r;
+}
+
+// Produces a value from the normal distribution of given mean and deviation.
+// Use prng_fill_normal() for many values, it keeps both values of each pair.
+fn double prng_normal(prng_state *state, double mean, double stddev)
+{
+	double x, y;
+
+	__prng_normal_pair(state, &x, &y);
+	return mean + stddev * x;
+}
+
+// Zipf over n ranks with exponent s, sampled by rejection-inversion
+// (Hormann and Derflinger), O(1) per sample without any table.
+typedef struct prng_zipf {
+	u64 n;
+	double s;
+	double h_x1; // H(1.5) - 1
+	double h_n; // H(n + 0.5)
+	double skip;
+} prng_zipf;
+
+// log1p(x) / x, continued to x = 0
+fn double __zipf_log1p_div(double x)
+{
+	return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+// expm1(x) / x, continued to x = 0
+fn double __zipf_expm1_div(double x)
+{
+	return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+// H(x), the integral of x^-s.
+fn double __zipf_h_integral(prng_zipf *zipf, double x)
+{
+	double lx = log(x);
+	return __zipf_expm1_div((1 - zipf->s) * lx) * lx;
+}
+
+fn double __zipf_h(prng_zipf *zipf, double x)
+{
+	return exp(-zipf->s * log(x));
+}
+
+fn double __zipf_h_integral_inverse(prng_zipf *zipf, double x)
+{
+	double t = x * (1 - zipf->s);
+
+	if (t < -1)
+		t = -1;
+
+	return exp(__zipf_log1p_div(t) * x);
+}
+
+// Prepare Zipf over n ranks (n > 0) with exponent s (s > 0).
+fn void prng_zipf_init(prng_zipf *zipf, u64 n, double s)
+{
+	zipf->n = n;
+	zipf->s = s;
+	zipf->h_x1 = __zipf_h_integral(zipf, 1.5) - 1;
+	zipf->h_n = __zipf_h_integral(zipf, n + 0.5);
+	zipf->skip = 2 - __zipf_h_integral_inverse(zipf, __zipf_h_integral(zipf, 2.5) - __zipf_h(zipf, 2));
+}
+
+// Produces a rank in the range [0, n), rank 0 being the most frequent.
+fn u64 prng_zipf_next(prng_state *state, prng_zipf *zipf)
+{
+	double u, x;
+	u64 k;
+
+	for (;;) {
+		u = zipf->h_n + prng_double(state) * (zipf->h_x1 - zipf->h_n);
+		x = __zipf_h_integral_inverse(zipf, u);
+
+		k = x + 0.5 < 1 ? 1 : (u64) (x + 0.5);
+		if (k > zipf->n)
+			k = zipf->n;
+
+		if (k - x <= zipf->skip || u >= __zipf_h_integral(zipf, k + 0.5) - __zipf_h(zipf, k))
+			return k - 1;
+	}
+}
+
+//
+// Batch distributions
+//
+
+// Batches draw raw bits with prng_bytes(), which uses the wide engine for
+// large arrays, then transform them in place in a vectorizable loop.
+
+fn void prng_fill_u64(prng_state *state, u64 *out, size_t n)
+{
+	prng_bytes(state, (u8 *) out, n * sizeof(u64));
+}
+
+// Fill with values in the range [0, bound), bound must not be 0.
+// The rejection threshold costs a single division per batch.
+fn void prng_fill_below(prng_state *state, u64 *out, size_t n, u64 bound)
+{
+	u64 threshold = -bound % bound;
+
+	prng_fill_u64(state, out, n);
+
+	for (size_t i = 0; i < n; i++) {
+		__uint128_t m = (__uint128_t) out[i] * bound;
+
+		if (unlikely((u64) m < threshold))
+			out[i] = prng_below(state, bound);
+		else
+			out[i] = (u64) (m >> 64);
+	}
+}
+
+fn void prng_fill_double(prng_state *state, double *out, size_t n)
+{
+	u64 bits;
+
+	prng_bytes(state, (u8 *) out, n * sizeof(double));
+
+	for (size_t i = 0; i < n; i++) {
+		memcpy(&bits, &out[i], sizeof(bits));
+		out[i] = (bits >> 11) * 0x1.0p-53;
+	}
+}
+
+fn void prng_fill_float(prng_state *state, float *out, size_t n)
+{
+	u32 bits;
+
+	prng_bytes(state, (u8 *) out, n * sizeof(float));
+
+	for (size_t i = 0; i < n; i++) {
+		memcpy(&bits, &out[i], sizeof(bits));
+		out[i] = (bits >> 8) * 0x1.0p-24f;
+	}
+}
+
+fn void prng_fill_exponential(prng_state *state, double *out, size_t n, double lambda)
+{
+	prng_fill_double(state, out, n);
+
+	for (size_t i = 0; i < n; i++)
+		out[i] = -log1p(-out[i]) / lambda;
+}
+
+fn void prng_fill_normal(prng_state *state, double *out, size_t n, double mean, double stddev)
+{
+	double x, y;
+	size_t i;
+
+	for (i = 0; i + 1 < n; i += 2) {
+		__prng_normal_pair(state, &x, &y);
+		out[i] = mean + stddev * x;
+		out[i + 1] = mean + stddev * y;
+	}
+
+	if (i < n)
+		out[i] = prng_normal(state, mean, stddev);
+}
+
+// Fill with geometric values, p must be in (0, 1] as for prng_geometric().
+fn void prng_fill_geometric(prng_state *state, u64 *out, size_t n, double p)
+{
+	double scale = p < 1 ? 1 / log1p(-p) : 0;
+	u64 bits;
+
+	if (!(p > 0 && p <= 1)) {
+		for (size_t i = 0; i < n; i++)
+			out[i] = UINT64_MAX;
+		return;
+	}
+
+	prng_fill_u64(state, out, n);
+
+	for (size_t i = 0; i < n; i++) {
+		bits = out[i];
+		out[i] = __prng_geometric_u64(floor(log1p(-((bits >> 11) * 0x1.0p-53)) * scale));
+	}
+}
+
+fn void prng_fill_zipf(prng_state *state, prng_zipf *zipf, u64 *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = prng_zipf_next(state, zipf);
+}
+
 //
 // Kernel compatibility
 //
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "headers.h"
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+#include "interactive.h"
+#include "printer.h"
+
+//
+// Ring backing
+//
+
+#define RING_MALLOC 0
+#define RING_MMAP 1 // Backed by mmap_alloc()
+#define RING_HUGE 2 // Backed by mmap_alloc_huge()
+
+#define __RING_CACHELINE 64
+
+// Allocate ring storage, handle is set for mmap backed storage.
+fn void *__ring_alloc(size_t size, int backing, mmap_alloc_handle **handle)
+{
+	*handle = NULL;
+
+	switch (backing) {
+	case RING_MMAP:
+		*handle = mmap_alloc(size);
+		break;
+	case RING_HUGE:
+		*handle = mmap_alloc_huge(size, PMD_SIZE);
+		break;
+	default:
+		return aligned_alloc(__RING_CACHELINE, ALIGN(size, __RING_CACHELINE));
+	}
+
+	return *handle ? (*handle)->map : NULL;
+}
+
+fn void __ring_free(void *ptr, mmap_alloc_handle *handle)
+{
+	if (handle)
+		mmap_free(handle);
+	else
+		free(ptr);
+}
+
+fn bool __ring_capacity_valid(size_t capacity)
+{
+	if (capacity < 2 || (capacity & (capacity - 1))) {
+		pr("Ring capacity %zu is not a power of two", capacity);
+		return false;
+	}
+
+	return true;
+}
+
+//
+// Lock-free rings
+//
+
+// Declare a bounded SPSC ring and a Vyukov MPMC ring of given type with given name suffix.
+//
+// spsc_<name>: one producer, one consumer. Each side owns its index and keeps
+// a cached copy of the other side's, so the shared cache line is only read
+// when the cached view runs out.
+//
+// mpmc_<name>: every cell carries a sequence number telling whether it is
+// ready for the producer or the consumer of a given lap, positions are claimed
+// with CAS.
+#define ring_decl(name, type) \
+typedef struct spsc_##name { \
+	u64 head __attribute__((aligned(__RING_CACHELINE))); /* Consumer */ \
+	u64 tail_cache; \
+	u64 tail __attribute__((aligned(__RING_CACHELINE))); /* Producer */ \
+	u64 head_cache; \
+	u64 mask __attribute__((aligned(__RING_CACHELINE))); \
+	type *slots; \
+	mmap_alloc_handle *handle; \
+} spsc_##name; \
+\
+fn int spsc_##name##_init(spsc_##name *ring, size_t capacity, int backing) \
+{ \
+	if (!__ring_capacity_valid(capacity)) \
+		return -1; \
+	ring->head = ring->tail_cache = 0; \
+	ring->tail = ring->head_cache = 0; \
+	ring->mask = capacity - 1; \
+	ring->slots = __ring_alloc(capacity * sizeof(type), backing, &ring->handle); \
+	return ring->slots ? 0 : -1; \
+} \
+\
+fn void spsc_##name##_destroy(spsc_##name *ring) \
+{ \
+	__ring_free(ring->slots, ring->handle); \
+	ring->slots = NULL; \
+	ring->handle = NULL; \
+} \
+\
+/* Enqueue up to count items, return the number enqueued. */ \
+fn size_t spsc_##name##_push_batch(spsc_##name *ring, const type *items, size_t count) \
+{ \
+	u64 tail = ring->tail; \
+	u64 room = ring->mask + 1 - (tail - ring->head_cache); \
+	if (room < count) { \
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE); \
+		room = ring->mask + 1 - (tail - ring->head_cache); \
+		if (room < count) \
+			count = room; \
+	} \
+	for (size_t i = 0; i < count; i++) \
+		ring->slots[(tail + i) & ring->mask] = items[i]; \
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE); \
+	return count; \
+} \
+\
+/* Dequeue up to count items, return the number dequeued. */ \
+fn size_t spsc_##name##_pop_batch(spsc_##name *ring, type *items, size_t count) \
+{ \
+	u64 head = ring->head; \
+	u64 avail = ring->tail_cache - head; \
+	if (avail < count) { \
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); \
+		avail = ring->tail_cache - head; \
+		if (avail < count) \
+			count = avail; \
+	} \
+	for (size_t i = 0; i < count; i++) \
+		items[i] = ring->slots[(head + i) & ring->mask]; \
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE); \
+	return count; \
+} \
+\
+fn bool spsc_##name##_push(spsc_##name *ring, type item) \
+{ \
+	return spsc_##name##_push_batch(ring, &item, 1); \
+} \
+\
+fn bool spsc_##name##_pop(spsc_##name *ring, type *item) \
+{ \
+	return spsc_##name##_pop_batch(ring, item, 1); \
+} \
+\
+typedef struct __mpmc_##name##_cell { \
+	u64 seq; \
+	type data; \
+} __mpmc_##name##_cell; \
+\
+typedef struct mpmc_##name { \
+	u64 enqueue __attribute__((aligned(__RING_CACHELINE))); \
+	u64 dequeue __attribute__((aligned(__RING_CACHELINE))); \
+	u64 mask __attribute__((aligned(__RING_CACHELINE))); \
+	__mpmc_##name##_cell *cells; \
+	mmap_alloc_handle *handle; \
+} mpmc_##name; \
+\
+fn int mpmc_##name##_init(mpmc_##name *ring, size_t capacity, int backing) \
+{ \
+	if (!__ring_capacity_valid(capacity)) \
+		return -1; \
+	ring->enqueue = 0; \
+	ring->dequeue = 0; \
+	ring->mask = capacity - 1; \
+	ring->cells = __ring_alloc(capacity * sizeof(__mpmc_##name##_cell), backing, &ring->handle); \
+	if (!ring->cells) \
+		return -1; \
+	for (size_t i = 0; i < capacity; i++) \
+		ring->cells[i].seq = i; \
+	return 0; \
+} \
+\
+fn void mpmc_##name##_destroy(mpmc_##name *ring) \
+{ \
+	__ring_free(ring->cells, ring->handle); \
+	ring->cells = NULL; \
+	ring->handle = NULL; \
+} \
+\
+fn bool mpmc_##name##_push(mpmc_##name *ring, type item) \
+{ \
+	__mpmc_##name##_cell *cell; \
+	u64 pos = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED); \
+	s64 diff; \
+	for (;;) { \
+		cell = &ring->cells[pos & ring->mask]; \
+		diff = (s64) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (s64) pos; \
+		if (diff == 0) { \
+			if (__atomic_compare_exchange_n(&ring->enqueue, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+				break; \
+		} else if (diff < 0) { \
+			return false; /* Full */ \
+		} else { \
+			pos = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED); \
+		} \
+	} \
+	cell->data = item; \
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE); \
+	return true; \
+} \
+\
+fn bool mpmc_##name##_pop(mpmc_##name *ring, type *item) \
+{ \
+	__mpmc_##name##_cell *cell; \
+	u64 pos = __atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED); \
+	s64 diff; \
+	for (;;) { \
+		cell = &ring->cells[pos & ring->mask]; \
+		diff = (s64) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (s64) (pos + 1); \
+		if (diff == 0) { \
+			if (__atomic_compare_exchange_n(&ring->dequeue, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+				break; \
+		} else if (diff < 0) { \
+			return false; /* Empty */ \
+		} else { \
+			pos = __atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED); \
+		} \
+	} \
+	*item = cell->data; \
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE); \
+	return true; \
+} \
+\
+/* Enqueue up to count items, stopping when full, return the number enqueued. */ \
+fn size_t mpmc_##name##_push_batch(mpmc_##name *ring, const type *items, size_t count) \
+{ \
+	size_t i = 0; \
+	while (i < count && mpmc_##name##_push(ring, items[i])) \
+		i++; \
+	return i; \
+} \
+\
+/* Dequeue up to count items, stopping when empty, return the number dequeued. */ \
+fn size_t mpmc_##name##_pop_batch(mpmc_##name *ring, type *items, size_t count) \
+{ \
+	size_t i = 0; \
+	while (i < count && mpmc_##name##_pop(ring, &items[i])) \
+		i++; \
+	return i; \
+}
+
+ring_decl(u64, u64)
@@ -3,6 +3,7 @@
 #include "headers.h"
 #include "common.h"
 #include "kernel.h"
+#include "cpu.h"
 
 fn u64 get_current_ns(void)
 {
@@ -15,3 +16,117 @@ fn u64 get_current_ns(void)
 }
 
 #define ktime_get_ns() get_current_ns()
+
+//
+// TSC timer
+//
+
+// Check if the TSC runs at a constant rate across P-/C-states (CPUID.80000007H:EDX[8]).
+fn bool tsc_invariant(void)
+{
+	return cpu_has(CPU_INVARIANT_TSC);
+}
+
+// Read TSC at the start of a timed region.
+// LFENCE keeps RDTSC from running ahead of earlier instructions.
+fn u64 tsc_start(void)
+{
+	u32 lo, hi;
+
+	__asm__ __volatile__(
+		"lfence\n"
+		"rdtsc\n"
+		: "=a"(lo), "=d"(hi)
+		:
+		: "memory"
+	);
+
+	return ((u64) hi << 32) | lo;
+}
+
+// Read TSC at the end of a timed region.
+// RDTSCP waits for earlier instructions, LFENCE keeps later ones from starting early.
+fn u64 tsc_stop(void)
+{
+	u32 lo, hi;
+
+	__asm__ __volatile__(
+		"rdtscp\n"
+		"lfence\n"
+		: "=a"(lo), "=d"(hi)
+		:
+		: "rcx", "memory"
+	);
+
+	return ((u64) hi << 32) | lo;
+}
+
+typedef struct tsc_clock {
+	double ns_per_cycle;
+	u64 overhead; // Cycles of an empty tsc_start()/tsc_stop() pair
+	bool invariant;
+} tsc_clock;
+
+mut tsc_clock __tsc_clock = { 0 };
+mut pthread_once_t __tsc_clock_once = PTHREAD_ONCE_INIT;
+
+#define TSC_CALIBRATE_NS (50 * NSEC_PER_MSEC)
+
+fn void __tsc_calibrate(void)
+{
+	u64 ns0, ns1, c0, c1;
+	u64 overhead = -1ULL;
+
+	__tsc_clock.invariant = tsc_invariant();
+	if (!__tsc_clock.invariant)
+		pr_warn("TSC is not invariant, cycle to ns conversion may drift\n");
+
+	c0 = tsc_start();
+	ns0 = get_current_ns();
+
+	do {
+		ns1 = get_current_ns();
+	} while (ns1 - ns0 < TSC_CALIBRATE_NS);
+
+	c1 = tsc_stop();
+
+	__tsc_clock.ns_per_cycle = (ns1 - ns0) * 1.0 / (c1 - c0);
+
+	for (int i = 0; i < 1000; i++) {
+		u64 begin = tsc_start();
+		u64 end = tsc_stop();
+
+		if (end - begin < overhead)
+			overhead = end - begin;
+	}
+
+	__tsc_clock.overhead = overhead;
+}
+
+// Get the TSC clock, calibrated once against CLOCK_MONOTONIC on first use.
+fn const tsc_clock *tsc_get_clock(void)
+{
+	pthread_once(&__tsc_clock_once, __tsc_calibrate);
+	return &__tsc_clock;
+}
+
+// Convert TSC cycles into ns.
+fn u64 tsc_to_ns(u64 cycles)
+{
+	return cycles * tsc_get_clock()->ns_per_cycle;
+}
+
+// Get the cycles elapsed between tsc_start() and tsc_stop(), minus the timer overhead.
+fn u64 tsc_elapsed(u64 start, u64 stop)
+{
+	u64 cycles = stop - start;
+	u64 overhead = tsc_get_clock()->overhead;
+
+	return cycles > overhead ? cycles - overhead : 0;
+}
+
+// Get the ns elapsed between tsc_start() and tsc_stop(), minus the timer overhead.
+fn u64 tsc_elapsed_ns(u64 start, u64 stop)
+{
+	return tsc_to_ns(tsc_elapsed(start, stop));
+}